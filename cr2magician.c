@@ -24,9 +24,31 @@
  *                                                                           *
  *****************************************************************************/
 
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE /* copy_file_range */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define HAVE_AVX2_TARGET 1
+#endif
 
 #ifndef LITTLE_ENDIAN
 	#define LITTLE_ENDIAN 1234
@@ -40,6 +62,7 @@
 typedef unsigned char u8;
 typedef unsigned short int u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 
 /* SIGNED TYPES */
 typedef signed char s8;
@@ -58,6 +81,33 @@ typedef enum bool {false = 0, true} boolean;
 /*** FILE's FUNCTIONS DEFAULT PARAMS ***/
 #define DEFAULT_FILE_PARAMS FILE* stream
 
+/*** TIFF TYPES ***/
+#define TIFF_TYPE_BYTE      1
+#define TIFF_TYPE_ASCII     2
+#define TIFF_TYPE_SHORT     3
+#define TIFF_TYPE_LONG      4
+#define TIFF_TYPE_RATIONAL  5
+#define TIFF_TYPE_SBYTE     6
+#define TIFF_TYPE_UNDEFINED 7
+#define TIFF_TYPE_SSHORT    8
+#define TIFF_TYPE_SLONG     9
+#define TIFF_TYPE_SRATIONAL 10
+#define TIFF_TYPE_FLOAT     11
+#define TIFF_TYPE_DOUBLE    12
+#define TIFF_TYPE_LAST      12
+
+/*** BIGGEST VALUE READ FROM A TAG (CORRUPTED COUNTS) ***/
+#define MAX_TAG_VALUE_SIZE (1 << 24)
+
+/*** SANITIZE ***/
+#define COPY_BUFFER_SIZE (1 << 20)
+#define SENSITIVE_VALUE_MIN_LENGTH 4
+#define MAX_SENSITIVE_VALUES       6
+
+/*** SIZE OF AN IFD DIRECTORY ENTRY AND OF ITS VALUE FIELD ***/
+#define IFD_ENTRY_SIZE       12
+#define IFD_ENTRY_VALUE_SIZE 4
+
 /*** NUMBER OF IFD IN A .CR2 FILE ***/
 #define NUMBER_OF_IFD 4
 
@@ -75,6 +125,60 @@ typedef enum bool {false = 0, true} boolean;
 #define CR2_TAG_LENS_MODEL    0x0095
 #define CR2_TAG_COLOR_SPACE   0x00B4
 #define CR2_TAG_FOCAL_LENGTH  0x0002
+#define CR2_TAG_STRIP_OFFSETS     0x0111
+#define CR2_TAG_STRIP_BYTE_COUNTS 0x0117
+#define CR2_TAG_CR2_SLICE         0xC640
+#define CR2_TAG_SENSOR_INFO       0x00E0
+#define CR2_TAG_COLOR_DATA        0x4001
+#define CR2_TAG_GPS               0x8825
+#define CR2_TAG_SERIAL_NUMBER          0x000C
+#define CR2_TAG_INTERNAL_SERIAL_NUMBER 0x0096
+#define CR2_TAG_CAMERA_OWNER_NAME      0xA430
+#define CR2_TAG_BODY_SERIAL_NUMBER     0xA431
+#define CR2_TAG_LENS_SERIAL_NUMBER     0xA435
+#define CR2_TAG_JPEG_OFFSET            0x0201
+#define CR2_TAG_JPEG_LENGTH            0x0202
+#define CR2_TAG_CAMERA_SETTINGS        0x0001
+#define CR2_TAG_SHOT_INFO              0x0004
+
+/*** IFD THAT CONTAINS THE RAW SENSOR DATA ***/
+#define RAW_IFD_ID 3
+
+/*** LOSSLESS JPEG MARKERS (IFD#3 RAW DATA) ***/
+#define JPEG_MARKER_SOI  0xD8
+#define JPEG_MARKER_EOI  0xD9
+#define JPEG_MARKER_SOF3 0xC3
+#define JPEG_MARKER_DHT  0xC4
+#define JPEG_MARKER_SOS  0xDA
+#define JPEG_MARKER_TEM  0x01
+#define JPEG_MARKER_RST0 0xD0
+#define JPEG_MARKER_RST7 0xD7
+
+/*** HEADER MAGIC WORDS ***/
+#define TIFF_MAGIC_WORD 0x002A
+#define CR2_MAGIC_WORD  0x5243
+
+/*** RAW HASHING ***/
+#define SHA256_DIGEST_SIZE 32
+#define HASH_CHUNK_SIZE    (1 << 20)
+
+/*** COLUMNAR CATALOGUE ***/
+#define CATALOGUE_MAGIC          "CR2CAT01"
+#define CATALOGUE_VERSION        1
+#define CATALOGUE_ALIGNMENT      64
+#define CATALOGUE_COLUMN_NAME    16
+#define CATALOGUE_TYPE_U16       1 /* u16 per row */
+#define CATALOGUE_TYPE_U64       2 /* u64 per row */
+#define CATALOGUE_TYPE_RATIONAL  3 /* numerator and denominator (u32) per row */
+#define CATALOGUE_TYPE_CODE      4 /* u32 per row, index in the "<name>.dict" column */
+#define CATALOGUE_TYPE_STRINGS   5 /* u32 count, u32 offsets[count + 1], characters */
+#define CATALOGUE_TYPE_ROW_INDEX 6 /* u32 row indexes */
+#define CATALOGUE_DICTIONARIES   3
+#define CATALOGUE_COLUMNS        14
+
+/*** PREVIEW RENDERING ***/
+#define PREVIEW_LUT_SIZE 4096
+#define MAX_THREADS      16
 
 /*** USEFUL MACROS ***/
 #define BYTE_TO_LITTLE_ENDIAN(byte)     ((((byte)  >>  4) & 0x0F)       | (((byte)  << 4) & 0xF0))
@@ -124,11 +228,14 @@ typedef struct {
  * the size of it.
  * next_IFD_offset is used for identifing the next IFD section.
  * If it is equal to 0, it means that it is the last IFD section.
+ * offset is the position of the IFD in the file, used for
+ * finding the directory entries when they are edited.
  */
 typedef struct {
 	CR2_IFD_Directory_Entry *dir_entries;
 	u16 dir_entries_length;
 	u32 next_IFD_offset;
+	u32 offset;
 } CR2_IFD;
 
 
@@ -148,9 +255,348 @@ typedef struct {
 	u16 focal_length;
 	u16 image_width;
 	u16 compression;
+	u32 exposure_time_rational[2];
+	u32 f_number_rational[2];
 } CR2_Image_Info;
 
 
+/**
+ * CR2_Raw_Image
+ * It contains the Bayer plane decoded from the IFD#3 lossless jpeg,
+ * already reassembled from the CR2 vertical slices.
+ * Every sample is stored in a u16, row by row (width * height samples).
+ */
+typedef struct {
+	u16 *data;
+	u32 width;
+	u32 height;
+	u16 bits;
+} CR2_Raw_Image;
+
+/**
+ * CR2_Raw_Params
+ * Sensor parameters taken from the MakerNote, needed to develop the raw:
+ * the active area of the sensor (SensorInfo, inclusive coordinates),
+ * the black level measured on the masked left border and the
+ * white balance multipliers (ColorData, WB_RGGBLevelsAsShot),
+ * normalized so that green is 1.0.
+ */
+typedef struct {
+	u16 left_border;
+	u16 top_border;
+	u16 right_border;
+	u16 bottom_border;
+	u16 black_level;
+	u16 white_level;
+	float wb[4]; /* R, G1, G2, B */
+} CR2_Raw_Params;
+
+/**
+ * CR2_Preview
+ * An 8 bit RGB image (3 bytes per pixel, row by row).
+ */
+typedef struct {
+	u8 *data;
+	u32 width;
+	u32 height;
+} CR2_Preview;
+
+/**
+ * CR2_Band_Function
+ * Work done by a thread on the rows [first_row, last_row) of an image.
+ * band_id goes from 0 to the number of bands - 1.
+ */
+typedef void (*CR2_Band_Function)(void *context, u32 first_row, u32 last_row, u32 band_id);
+
+/**
+ * CR2_Huffman_Table
+ * Lookup table indexed by the next 16 bits of the entropy coded data.
+ * Every element is (code length << 8) | symbol, 0 if the code isn't valid.
+ */
+typedef struct {
+	u16 lookup[1 << 16];
+} CR2_Huffman_Table;
+
+/**
+ * CR2_Bit_Reader
+ * Reads the entropy coded segment of a jpeg, removing the stuffed 0x00
+ * after every 0xFF. The valid bits are the most significant bit_count
+ * bits of bit_buffer. When a marker is reached it returns only zeros.
+ */
+typedef struct {
+	const u8 *data;
+	u32 length;
+	u32 position;
+	u32 bit_buffer;
+	int bit_count;
+	boolean corrupted;
+} CR2_Bit_Reader;
+
+/**
+ * CR2_Render_Context
+ * Shared by the threads that render the half size preview.
+ */
+typedef struct {
+	CR2_Raw_Image *raw;
+	CR2_Preview *preview;
+	u32 left;
+	u32 top;
+	u16 black_level;
+	float scale[3]; /* R, G, B: from (raw - black) to a LUT index */
+	u8 lut[PREVIEW_LUT_SIZE];
+} CR2_Render_Context;
+
+/**
+ * CR2_Band
+ * The rows assigned to a single thread by CR2_run_bands.
+ */
+typedef struct {
+	CR2_Band_Function function;
+	void *context;
+	u32 first_row;
+	u32 last_row;
+	u32 band_id;
+} CR2_Band;
+
+/**
+ * CR2_Raw_Stats
+ * Statistics of the raw image used for quality control:
+ *   - one histogram for each channel of the active area (R, G1, G2, B),
+ *     with (1 << bits) bins;
+ *   - the white level and the number of clipped pixels (>= white level)
+ *     for each channel;
+ *   - mean and standard deviation of the masked black border.
+ */
+typedef struct {
+	u32 *histograms[4];
+	u32 histogram_size;
+	u16 white_level;
+	u64 clipped[4];
+	u64 black_count;
+	double black_mean;
+	double black_stddev;
+} CR2_Raw_Stats;
+
+/**
+ * CR2_Stats_Partial
+ * The statistics computed by a single thread, merged at the end.
+ */
+typedef struct {
+	u32 *histograms[4];
+	u64 black_sum;
+	u64 black_sum_squares;
+	u64 black_count;
+} CR2_Stats_Partial;
+
+/**
+ * CR2_Stats_Context
+ * Shared by the threads that compute the raw statistics.
+ */
+typedef struct {
+	CR2_Raw_Image *raw;
+	CR2_Raw_Params *params;
+	u32 left;
+	u32 top;
+	boolean use_AVX2;
+	CR2_Stats_Partial partials[MAX_THREADS];
+} CR2_Stats_Context;
+
+/**
+ * CR2_Raw_Hash
+ * Content hash of the IFD#3 raw strip of a file: it doesn't change if
+ * only the metadata or the previews of the file are edited.
+ * The SHA-256 is computed only if use_SHA256 is true.
+ */
+typedef struct {
+	const char *file_name;
+	u32 strip_offset;
+	u32 strip_length;
+	boolean use_SHA256;
+	boolean valid;
+	u64 XXH64;
+	u8 SHA256[SHA256_DIGEST_SIZE];
+} CR2_Raw_Hash;
+
+/**
+ * CR2_XXH64_Context
+ * State of a streaming XXH64 computation: the four accumulators and the
+ * bytes that do not fill a 32 byte stripe yet.
+ */
+typedef struct {
+	u64 v[4];
+	u64 seed;
+	u64 length;
+	u8 buffer[32];
+	u32 buffer_length;
+} CR2_XXH64_Context;
+
+/**
+ * CR2_SHA256_Context
+ * State of a SHA-256 computation (FIPS 180-4).
+ */
+typedef struct {
+	u32 state[8];
+	u8 block[64];
+	u32 block_length;
+	u64 length;
+} CR2_SHA256_Context;
+
+/**
+ * CR2_Dictionary
+ * The distinct strings of a dictionary encoded column.
+ * slots is an open addressing hash table (XXH64) that contains
+ * the index of the string + 1, or 0 if the slot is empty.
+ */
+typedef struct {
+	char **strings;
+	u32 count;
+	u32 capacity;
+	u32 *slots;
+	u32 number_of_slots;
+} CR2_Dictionary;
+
+/**
+ * CR2_Catalogue
+ * The columns of the catalogue, built in memory during a batch scan.
+ * Dates are stored as YYYYMMDDhhmmss, so their order is the time order
+ * (0 if the date is missing).
+ */
+typedef struct {
+	u32 rows;
+	u32 capacity;
+	u16 *image_width;
+	u16 *image_height;
+	u16 *focal_length;
+	u16 *compression;
+	u32 *exposure_time;
+	u32 *f_number;
+	u32 *codes[CATALOGUE_DICTIONARIES]; /* model, lens, owner */
+	u64 *date;
+	CR2_Dictionary dictionaries[CATALOGUE_DICTIONARIES];
+} CR2_Catalogue;
+
+/**
+ * CR2_Catalogue_Header
+ * Catalogue file format (host byte order, every column aligned to 64 bytes):
+ *   CR2_Catalogue_Header
+ *   CR2_Catalogue_Column[number_of_columns]
+ *   column data
+ * A reader maps the file and uses each column as an array.
+ */
+typedef struct {
+	char magic[8];
+	u32 version;
+	u32 number_of_rows;
+	u32 number_of_columns;
+	u32 reserved;
+} CR2_Catalogue_Header;
+
+typedef struct {
+	char name[CATALOGUE_COLUMN_NAME];
+	u32 type;
+	u32 reserved;
+	u64 offset;
+	u64 length;
+} CR2_Catalogue_Column;
+
+/**
+ * CR2_TIFF_Type
+ * Description of a TIFF type: its name, the size of a value, and the size
+ * of the parts of a value that are stored in the byte order of the file
+ * (a RATIONAL is made of two LONG).
+ */
+typedef struct {
+	const char *name;
+	u8 size;
+	u8 swap_size;
+} CR2_TIFF_Type;
+
+/**
+ * CR2_Tag
+ * A node of a CR2_Tag_Tree. values (the decoded values, in host byte order)
+ * and children (the tree of a tag that points to another IFD) are NULL
+ * until they are accessed for the first time.
+ */
+typedef struct CR2_Tag_Tree CR2_Tag_Tree;
+
+typedef struct {
+	CR2_IFD_Directory_Entry entry;
+	void *values;
+	CR2_Tag_Tree *children;
+} CR2_Tag;
+
+/**
+ * CR2_Tag_Tree
+ * The tags of an IFD, with their sub IFDs (EXIF, MakerNote, GPS)
+ * and their values materialized lazily from the stream.
+ */
+struct CR2_Tag_Tree {
+	FILE *stream;
+	CR2_IFD ifd;
+	CR2_Tag *tags;
+};
+
+/**
+ * CR2_MakerNote_Field
+ * A named element of a Canon MakerNote array (CameraSettings, ShotInfo,
+ * SensorInfo, ColorData). index is the position in the array of SHORT.
+ */
+typedef struct {
+	u16 array_tag;
+	u16 index;
+	boolean is_signed;
+	const char *name;
+} CR2_MakerNote_Field;
+
+/**
+ * CR2_Color_Data_Version
+ * A known length of the Canon ColorData array, with the index of
+ * WB_RGGBLevelsAsShot and SpecularWhiteLevel in that version of the array
+ * (0 when the version does not have it).
+ */
+typedef struct {
+	u16 count;
+	u16 wb_index;
+	u16 white_level_index;
+} CR2_Color_Data_Version;
+
+/**
+ * CR2_Range
+ * A range of bytes of the file (i.e. an image strip).
+ */
+typedef struct {
+	u64 offset;
+	u64 length;
+} CR2_Range;
+
+/**
+ * CR2_Sensitive_Values
+ * The ASCII values blanked by the sanitize mode (owner names and serial
+ * numbers), whose other copies in the file are blanked too.
+ */
+typedef struct {
+	char *values[MAX_SENSITIVE_VALUES];
+	u32 count;
+} CR2_Sensitive_Values;
+
+/**
+ * CR2_Options
+ * What to do with every file, chosen from the command line.
+ */
+typedef struct {
+	const char *preview_path;
+	boolean print_stats;
+	boolean print_hash;
+	boolean use_SHA256;
+	const char *owner_name;
+	const char *date_time;
+	const char *sanitize_directory;
+	boolean verify;
+	const char *catalogue_path;
+	boolean print_makernote;
+	u16 white_level;
+} CR2_Options;
+
 /***************************************
  * Prototypes functions                *
  ***************************************/
@@ -164,6 +610,8 @@ s16 	get_sshort(DEFAULT_FILE_PARAMS);
 s32 	get_sint(DEFAULT_FILE_PARAMS);
 float   get_float(DEFAULT_FILE_PARAMS);
 double  get_double(DEFAULT_FILE_PARAMS);
+boolean put_ushort(DEFAULT_FILE_PARAMS, u16 value);
+boolean put_uint(DEFAULT_FILE_PARAMS, u32 value);
 
 /*** CR2 FUNCTIONS ***/
 byte_order CR2_determine_byte_order(u16 raw_byte_order);
@@ -174,6 +622,74 @@ boolean    CR2_destroy_IFD(CR2_IFD *ifd);
 boolean    CR2_print_IFD(FILE * stream, CR2_IFD * ifd, int IFD_id);
 boolean    CR2_get_image_info(FILE * stream, CR2_IFD * ifd, CR2_Image_Info * buffer);
 boolean    CR2_print_image_info(FILE * stream, CR2_Image_Info * info);
+boolean    CR2_destroy_image_info(CR2_Image_Info * info);
+CR2_IFD_Directory_Entry * CR2_find_entry(CR2_IFD * ifd, u16 tag_ID);
+u16*       CR2_get_ushort_array(FILE * stream, u32 offset, u32 count);
+boolean    CR2_get_makernote(FILE * stream, CR2_IFD * ifd, CR2_IFD * makernote);
+boolean    CR2_get_strip(CR2_IFD * ifd, u32 * offset, u32 * length);
+
+/*** RAW FUNCTIONS ***/
+boolean    CR2_decode_lossless_jpeg(const u8 * data, u32 length, u16 * slices, CR2_Raw_Image * raw);
+boolean    CR2_get_raw_image(FILE * stream, CR2_IFD * raw_ifd, CR2_Raw_Image * raw);
+boolean    CR2_destroy_raw_image(CR2_Raw_Image * raw);
+boolean    CR2_get_raw_params(FILE * stream, CR2_IFD * ifd, CR2_Raw_Image * raw, CR2_Raw_Params * params);
+u32        CR2_number_of_bands(u32 rows);
+u32        CR2_run_bands(CR2_Band_Function function, void * context, u32 rows);
+boolean    CR2_render_half_size(CR2_Raw_Image * raw, CR2_Raw_Params * params, CR2_Preview * preview);
+boolean    CR2_write_PPM(const char * path, CR2_Preview * preview);
+boolean    CR2_get_raw_stats(CR2_Raw_Image * raw, CR2_Raw_Params * params, CR2_Raw_Stats * stats);
+boolean    CR2_print_raw_stats(FILE * stream, CR2_Raw_Stats * stats);
+boolean    CR2_destroy_raw_stats(CR2_Raw_Stats * stats);
+
+/*** HASH FUNCTIONS ***/
+u64        XXH64(const u8 * data, u64 length, u64 seed);
+void       XXH64_init(CR2_XXH64_Context * context, u64 seed);
+void       XXH64_update(CR2_XXH64_Context * context, const u8 * data, u64 length);
+u64        XXH64_final(CR2_XXH64_Context * context);
+void       SHA256_init(CR2_SHA256_Context * context);
+void       SHA256_update(CR2_SHA256_Context * context, const u8 * data, u64 length);
+void       SHA256_final(CR2_SHA256_Context * context, u8 * digest);
+boolean    CR2_locate_raw_strip(const char * file_name, CR2_Raw_Hash * hash);
+boolean    CR2_hash_raw_strip(CR2_Raw_Hash * hash);
+void       CR2_hash_files(CR2_Raw_Hash * hashes, u32 count);
+boolean    CR2_print_raw_hash(FILE * stream, CR2_Raw_Hash * hash);
+
+/*** WRITE FUNCTIONS ***/
+boolean    CR2_sync(FILE * stream);
+boolean    CR2_set_ascii_tag(FILE * stream, CR2_IFD * ifd, u16 tag_ID, const char * value);
+boolean    CR2_valid_date_time(const char * date_time);
+u32        CR2_type_size(u16 tag_type);
+boolean    CR2_blank_tag(FILE * stream, CR2_IFD * ifd, u16 tag_ID);
+boolean    CR2_remove_entry(FILE * stream, CR2_IFD * ifd, u16 tag_ID);
+boolean    CR2_copy_file(int source_fd, int destination_fd, u64 length);
+boolean    CR2_sanitize(const char * source, const char * destination);
+boolean    CR2_blank_copies(FILE * stream, CR2_Sensitive_Values * sensitive);
+
+/*** VERIFY FUNCTIONS ***/
+const char* CR2_scan_lossless_jpeg(const u8 * data, u32 length, u32 * error_position);
+boolean    CR2_verify(const char * file_name, FILE * report);
+
+/*** CATALOGUE FUNCTIONS ***/
+void       CR2_catalogue_init(CR2_Catalogue * catalogue);
+void       CR2_catalogue_add(CR2_Catalogue * catalogue, CR2_Image_Info * info);
+boolean    CR2_catalogue_write(CR2_Catalogue * catalogue, const char * path);
+void       CR2_catalogue_destroy(CR2_Catalogue * catalogue);
+boolean    CR2_catalogue_lens_usage(const char * path, FILE * stream);
+
+/*** TYPED VALUES AND TAG TREE FUNCTIONS ***/
+const char* CR2_type_name(u16 tag_type);
+boolean    CR2_entry_is_inline(CR2_IFD_Directory_Entry * entry);
+void*      CR2_get_entry_values(FILE * stream, CR2_IFD_Directory_Entry * entry);
+s32        CR2_value_int(const void * values, u16 tag_type, u32 index);
+CR2_Tag_Tree* CR2_tag_tree_open(FILE * stream, u32 offset);
+CR2_Tag*   CR2_tag_find(CR2_Tag_Tree * tree, u16 tag_ID);
+const void* CR2_tag_values(CR2_Tag_Tree * tree, CR2_Tag * tag);
+CR2_Tag_Tree* CR2_tag_subtree(CR2_Tag_Tree * tree, u16 tag_ID);
+boolean    CR2_tag_tree_destroy(CR2_Tag_Tree * tree);
+u32        CR2_color_data_WB_index(u32 count);
+u32        CR2_color_data_white_level_index(u32 count);
+boolean    CR2_makernote_field(CR2_Tag_Tree * makernote, u16 array_tag, u32 index, s32 * value);
+boolean    CR2_print_makernote(FILE * stream, CR2_Tag_Tree * makernote);
 
 
 /***************************************
@@ -184,18 +700,138 @@ byte_order FILE_BYTE_ORDER;
 /***************************************
  * ENTRY POINT.
  ***************************************/
-int main(int argc, char *argv[]) {
-	CR2_Header *header = (CR2_Header*)malloc(sizeof(CR2_Header));
-	CR2_IFD *ifds[NUMBER_OF_IFD];
-	CR2_Image_Info *image_info = (CR2_Image_Info*)malloc(sizeof(CR2_Image_Info));
+static void usage(const char *program_name) {
+	fprintf(stderr, "Usage: %s [options] [file.CR2 ...]\n", program_name);
+	fprintf(stderr, "  -p, --preview FILE  render a half size preview from the raw data (PPM, one input file)\n");
+	fprintf(stderr, "  -s, --stats         print histograms, black level and clipping of the raw data\n");
+	fprintf(stderr, "  -H, --hash          print the XXH64 of the raw data, for duplicate detection\n");
+	fprintf(stderr, "  -S, --sha256        print also the SHA-256 of the raw data (implies --hash)\n");
+	fprintf(stderr, "  -o, --set-owner NAME  set the owner name, editing the file in place\n");
+	fprintf(stderr, "  -d, --set-date DATE   set the date (YYYY:MM:DD HH:MM:SS), editing the file in place\n");
+	fprintf(stderr, "  -x, --sanitize DIR    write into DIR a copy without owner, serial numbers and GPS\n");
+	fprintf(stderr, "  -V, --verify          check offsets, strips and the raw jpeg stream (truncated files)\n");
+	fprintf(stderr, "  -c, --catalogue FILE  write the image info of all the files in a columnar catalogue\n");
+	fprintf(stderr, "  -l, --lens-usage FILE print the lens usage histogram of a catalogue, and exit\n");
+	fprintf(stderr, "  -m, --makernote       print the decoded Canon MakerNote arrays\n");
+	fprintf(stderr, "  -w, --white-level N   saturation level for --stats and --preview (default: MakerNote)\n");
+	fprintf(stderr, "  -h, --help          show this help\n");
+	fprintf(stderr, "If no file is given, tmp.CR2 is used.\n");
+}
+
+/**
+ * edit_file
+ * It applies to the file the metadata edits chosen from the command line.
+ * It returns false if something goes wrong.
+ */
+static boolean edit_file(const char *file_name, CR2_Options *options) {
+	CR2_Header header;
+	CR2_IFD ifd;
+	CR2_IFD makernote;
+	boolean no_errors = true;
+	FILE *file;
+	
+	/* only a real CR2 is opened for writing: the offsets of other TIFF
+	   based files (i.e. relative MakerNote offsets) would be misread */
+	file = fopen(file_name, "rb");
+	if (file == NULL) {
+		perror("[ERROR-fopen]");
+		return false;
+	}
+	no_errors = CR2_get_header(file, &header) &&
+				header.TIFF_magic_word == TIFF_MAGIC_WORD && header.CR2_magic_word == CR2_MAGIC_WORD;
+	fclose(file);
+	if (!no_errors) {
+		fprintf(stderr, "[ERROR-edit_file] %s isn't a CR2 file\n", file_name);
+		return false;
+	}
+	
+	file = fopen(file_name, "r+b");
+	if (file == NULL) {
+		perror("[ERROR-fopen]");
+		return false;
+	}
+	
+	if (!CR2_get_header(file, &header) || CR2_get_IFD(file, &ifd, ftell(file)) == 0) {
+		fclose(file);
+		return false;
+	}
+	
+	if (options->date_time != NULL) {
+		no_errors = CR2_set_ascii_tag(file, &ifd, CR2_TAG_DATE_TIME, options->date_time);
+	}
+	
+	if (no_errors && options->owner_name != NULL) {
+		if (CR2_get_makernote(file, &ifd, &makernote)) {
+			no_errors = CR2_set_ascii_tag(file, &makernote, CR2_TAG_OWNER_NAME, options->owner_name);
+			free(makernote.dir_entries);
+		}
+		else {
+			no_errors = false;
+		}
+	}
+	
+	free(ifd.dir_entries);
+	return (fclose(file) == 0) && no_errors;
+}
 
-	FILE *file = fopen("tmp.CR2", "rb");
+/**
+ * process_file
+ * It prints the information of a file and runs the modes chosen
+ * from the command line. hash is the raw hash of the file, already
+ * computed, or NULL. If catalogue isn't NULL, the image info is added to it.
+ * It returns false if something goes wrong.
+ */
+static boolean process_file(const char *file_name, CR2_Options *options, CR2_Raw_Hash *hash, CR2_Catalogue *catalogue) {
+	CR2_Header *header = NULL;
+	CR2_IFD *ifds[NUMBER_OF_IFD] = {NULL};
+	CR2_Image_Info *image_info = NULL;
+	CR2_Raw_Image raw = {NULL, 0, 0, 0};
+	boolean no_errors = false;
+	FILE *file;
 	
 	u32 ifd_offset;
 	u32 i;
+	
+	/* a damaged file is reported and not parsed */
+	if (options->verify && !CR2_verify(file_name, stdout)) {
+		return false;
+	}
+	
+	if (options->owner_name != NULL || options->date_time != NULL) {
+		if (!edit_file(file_name, options)) {
+			fprintf(stderr, "[ERROR] Cannot edit %s\n", file_name);
+			return false;
+		}
+	}
+	
+	if (options->sanitize_directory != NULL) {
+		const char *base_name = strrchr(file_name, '/');
+		char *destination;
+		boolean sanitized;
 		
+		base_name = (base_name != NULL) ? base_name + 1 : file_name;
+		destination = (char*)malloc(strlen(options->sanitize_directory) + strlen(base_name) + 2);
+		sprintf(destination, "%s/%s", options->sanitize_directory, base_name);
+		sanitized = CR2_sanitize(file_name, destination);
+		free(destination);
+		if (!sanitized) {
+			fprintf(stderr, "[ERROR] Cannot sanitize %s\n", file_name);
+			return false;
+		}
+	}
+	
+	file = fopen(file_name, "rb");
+	if (file == NULL) {
+		perror("[ERROR-fopen]");
+		return false;
+	}
+	
+	/* from here every error goes to the cleanup, so that a batch of
+	   millions of files doesn't run out of memory or descriptors */
+	header = (CR2_Header*)malloc(sizeof(CR2_Header));
+	image_info = (CR2_Image_Info*)calloc(1, sizeof(CR2_Image_Info));
 	for (i = 0; i < NUMBER_OF_IFD; i++) {
-		ifds[i] = (CR2_IFD*)malloc(sizeof(CR2_IFD));
+		ifds[i] = (CR2_IFD*)calloc(1, sizeof(CR2_IFD));
 	}
 	
 	if (CR2_get_header(file, header)) {
@@ -203,7 +839,7 @@ int main(int argc, char *argv[]) {
 	}
 	else {
 		fprintf(stderr, "NOTHING TO DO...\n");
-		exit(EXIT_FAILURE);
+		goto cleanup;
 	}
 	
 	ifd_offset = ftell(file);
@@ -213,20 +849,221 @@ int main(int argc, char *argv[]) {
 		}
 		else {
 			fprintf(stderr, "NOTHING TO DO...\n");
-			exit(EXIT_FAILURE);
+			goto cleanup;
 		}
 		ifd_offset = ifds[i]->next_IFD_offset;
 	}
 	
 	if (CR2_get_image_info(file, ifds[0], image_info)) {
 		CR2_print_image_info(stdout, image_info);
+		if (catalogue != NULL) {
+			CR2_catalogue_add(catalogue, image_info);
+		}
 	}
 	else {
 		fprintf(stderr, "NOTHING TO DO...\n");
+		goto cleanup;
+	}
+	
+	if (options->print_makernote) {
+		CR2_Tag_Tree *tree = CR2_tag_tree_open(file, ifds[0]->offset);
+		CR2_Tag_Tree *exif = CR2_tag_subtree(tree, CR2_TAG_EXIF);
+		
+		CR2_print_makernote(stdout, CR2_tag_subtree(exif, CR2_TAG_MAKERNOTE));
+		CR2_tag_tree_destroy(tree);
+	}
+	
+	/* the raw data is decoded once for all the modes that need it */
+	if (options->preview_path != NULL || options->print_stats) {
+		CR2_Raw_Params params;
+		
+		if (!CR2_get_raw_image(file, ifds[RAW_IFD_ID], &raw) ||
+			!CR2_get_raw_params(file, ifds[0], &raw, &params)) {
+			fprintf(stderr, "[ERROR] Cannot decode the raw data of %s\n", file_name);
+			goto cleanup;
+		}
+		if (options->white_level != 0) {
+			if (options->white_level <= params.black_level) {
+				fprintf(stderr, "[ERROR] The white level of %s is below the black level\n", file_name);
+				goto cleanup;
+			}
+			params.white_level = options->white_level;
+		}
+		
+		if (options->print_stats) {
+			CR2_Raw_Stats stats;
+			
+			if (!CR2_get_raw_stats(&raw, &params, &stats)) {
+				fprintf(stderr, "[ERROR] Cannot compute the raw statistics of %s\n", file_name);
+				goto cleanup;
+			}
+			CR2_print_raw_stats(stdout, &stats);
+			CR2_destroy_raw_stats(&stats);
+		}
+		
+		if (options->preview_path != NULL) {
+			CR2_Preview preview = {NULL, 0, 0};
+			boolean rendered = CR2_render_half_size(&raw, &params, &preview) &&
+							   CR2_write_PPM(options->preview_path, &preview);
+			
+			free(preview.data);
+			if (!rendered) {
+				fprintf(stderr, "[ERROR] Cannot render the preview of %s\n", file_name);
+				goto cleanup;
+			}
+		}
+	}
+	
+	if (hash != NULL) {
+		CR2_print_raw_hash(stdout, hash);
+	}
+	no_errors = (hash == NULL || hash->valid);
+	
+cleanup:
+	CR2_destroy_raw_image(&raw);
+	CR2_destroy_image_info(image_info);
+	for (i = 0; i < NUMBER_OF_IFD; i++) {
+		CR2_destroy_IFD(ifds[i]);
+	}
+	free(header);
+	fclose(file);
+	
+	return no_errors;
+}
+
+int main(int argc, char *argv[]) {
+	static struct option long_options[] = {
+		{"preview", required_argument, NULL, 'p'},
+		{"stats",   no_argument,       NULL, 's'},
+		{"hash",    no_argument,       NULL, 'H'},
+		{"sha256",  no_argument,       NULL, 'S'},
+		{"set-owner", required_argument, NULL, 'o'},
+		{"set-date",  required_argument, NULL, 'd'},
+		{"sanitize",  required_argument, NULL, 'x'},
+		{"verify",    no_argument,       NULL, 'V'},
+		{"catalogue", required_argument, NULL, 'c'},
+		{"lens-usage", required_argument, NULL, 'l'},
+		{"makernote", no_argument,       NULL, 'm'},
+		{"white-level", required_argument, NULL, 'w'},
+		{"help",    no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	static char *default_files[] = {"tmp.CR2"};
+	CR2_Options options = {NULL, false, false, false, NULL, NULL, NULL, false, NULL, false, 0};
+	CR2_Raw_Hash *hashes = NULL;
+	CR2_Catalogue catalogue;
+	char **files;
+	u32 number_of_files;
+	boolean no_errors = true;
+	u32 i;
+	int option;
+	
+	while ((option = getopt_long(argc, argv, "p:sHSo:d:x:Vc:l:mw:h", long_options, NULL)) != -1) {
+		switch (option) {
+			case 'p':
+				options.preview_path = optarg;
+			break;
+			
+			case 's':
+				options.print_stats = true;
+			break;
+			
+			case 'S':
+				options.use_SHA256 = true;
+				/* fall through */
+			case 'H':
+				options.print_hash = true;
+			break;
+			
+			case 'o':
+				options.owner_name = optarg;
+			break;
+			
+			case 'd':
+				if (!CR2_valid_date_time(optarg)) {
+					fprintf(stderr, "[ERROR] Invalid date: %s (expected YYYY:MM:DD HH:MM:SS)\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				options.date_time = optarg;
+			break;
+			
+			case 'x':
+				options.sanitize_directory = optarg;
+			break;
+			
+			case 'V':
+				options.verify = true;
+			break;
+			
+			case 'c':
+				options.catalogue_path = optarg;
+			break;
+			
+			case 'l':
+				exit(CR2_catalogue_lens_usage(optarg, stdout) ? EXIT_SUCCESS : EXIT_FAILURE);
+			
+			case 'm':
+				options.print_makernote = true;
+			break;
+			
+			case 'w':
+				options.white_level = (u16)strtoul(optarg, NULL, 10);
+				if (options.white_level == 0) {
+					fprintf(stderr, "[ERROR] Invalid white level: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+			break;
+			
+			default:
+				usage(argv[0]);
+				exit((option == 'h') ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	
+	if (optind < argc) {
+		files = argv + optind;
+		number_of_files = argc - optind;
+	}
+	else {
+		files = default_files;
+		number_of_files = 1;
+	}
+	
+	/* a single preview file cannot hold the previews of a batch */
+	if (options.preview_path != NULL && number_of_files > 1) {
+		fprintf(stderr, "[ERROR] --preview accepts a single input file\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	exit(EXIT_SUCCESS);
+	/* the raw strips of all the files are hashed in parallel */
+	if (options.print_hash) {
+		hashes = (CR2_Raw_Hash*)calloc(number_of_files, sizeof(CR2_Raw_Hash));
+		for (i = 0; i < number_of_files; i++) {
+			hashes[i].use_SHA256 = options.use_SHA256;
+			if (!CR2_locate_raw_strip(files[i], &hashes[i])) {
+				fprintf(stderr, "[ERROR] Cannot locate the raw data of %s\n", files[i]);
+			}
+		}
+		CR2_hash_files(hashes, number_of_files);
+	}
+	
+	CR2_catalogue_init(&catalogue);
+	for (i = 0; i < number_of_files; i++) {
+		if (!process_file(files[i], &options, (hashes != NULL) ? &hashes[i] : NULL,
+						  (options.catalogue_path != NULL) ? &catalogue : NULL)) {
+			fprintf(stderr, "[ERROR] Cannot process %s\n", files[i]);
+			no_errors = false;
+		}
+	}
+	
+	if (options.catalogue_path != NULL && !CR2_catalogue_write(&catalogue, options.catalogue_path)) {
+		fprintf(stderr, "[ERROR] Cannot write the catalogue %s\n", options.catalogue_path);
+		no_errors = false;
+	}
+	CR2_catalogue_destroy(&catalogue);
+	
+	free(hashes);
+	exit(no_errors ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 /**
@@ -474,6 +1311,54 @@ double get_double(DEFAULT_FILE_PARAMS) {
 	return raw_data;	
 }
 
+/**
+ * put_ushort
+ * Params:
+ *  1. FILE stream used for writing data
+ *  2. the unsigned short to write, in the byte order of the file
+ * Return:
+ *  False if something goes wrong.
+ */
+boolean put_ushort(DEFAULT_FILE_PARAMS, u16 value) {
+	if (stream != NULL) {
+		if (IS_BIG_ENDIAN) {
+			value = WORD_TO_LITTLE_ENDIAN(value);
+		}
+		if (fwrite((u16*)&value, sizeof(u16), 1, stream) != 1) {
+			perror("[ERROR-fwrite]");
+			return false;
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * put_uint
+ * Params:
+ *  1. FILE stream used for writing data
+ *  2. the unsigned int to write, in the byte order of the file
+ * Return:
+ *  False if something goes wrong.
+ */
+boolean put_uint(DEFAULT_FILE_PARAMS, u32 value) {
+	if (stream != NULL) {
+		if (IS_BIG_ENDIAN) {
+			value = DWORD_TO_LITTLE_ENDIAN(value);
+		}
+		if (fwrite((u32*)&value, sizeof(u32), 1, stream) != 1) {
+			perror("[ERROR-fwrite]");
+			return false;
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
+
 /**
  * CR2_get_header
  * Params:
@@ -619,6 +1504,7 @@ u32 CR2_get_IFD(FILE * stream, CR2_IFD * ifd, u32 offset) {
 		}
 		
 		/* allocate the CR2_IFD Directory Entries array */
+		ifd->offset = offset;
 		ifd->dir_entries_length = dir_entries_length;
 		ifd->dir_entries = (CR2_IFD_Directory_Entry*)malloc(sizeof(CR2_IFD_Directory_Entry)*ifd->dir_entries_length);
 		
@@ -719,35 +1605,37 @@ boolean CR2_get_image_info(FILE * stream, CR2_IFD * ifd, CR2_Image_Info * buffer
 			switch (ifd->dir_entries[i].tag_ID) {
 								
 				case CR2_TAG_OWNER_NAME:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					buffer->owner_name = get_string(stream);
+					buffer->owner_name = (string)CR2_get_entry_values(stream, &ifd->dir_entries[i]);
 				break;
 								
 				case CR2_TAG_LENS_MODEL:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					buffer->lens_model = get_string(stream);
+					buffer->lens_model = (string)CR2_get_entry_values(stream, &ifd->dir_entries[i]);
 				break;
 				
 				case CR2_TAG_MODEL:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					buffer->model = get_string(stream);
+					buffer->model = (string)CR2_get_entry_values(stream, &ifd->dir_entries[i]);
 				break;				
 								
 				case CR2_TAG_IMAGE_WIDTH:
-					buffer->image_width = ifd->dir_entries[i].value;
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					buffer->image_width = CR2_value_int(values, ifd->dir_entries[i].tag_type, 0);
+					free(values);
 				break;
 				
 				case CR2_TAG_IMAGE_HEIGHT:
-					buffer->image_height = ifd->dir_entries[i].value;
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					buffer->image_height = CR2_value_int(values, ifd->dir_entries[i].tag_type, 0);
+					free(values);
 				break;
 				
 				case CR2_TAG_COMPRESSION:
-					buffer->compression = ifd->dir_entries[i].value;
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					buffer->compression = CR2_value_int(values, ifd->dir_entries[i].tag_type, 0);
+					free(values);
 				break;
 								
 				case CR2_TAG_DATE_TIME:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					buffer->date_time = get_string(stream);
+					buffer->date_time = (string)CR2_get_entry_values(stream, &ifd->dir_entries[i]);
 				break;
 				
 				case CR2_TAG_EXIF:
@@ -755,6 +1643,7 @@ boolean CR2_get_image_info(FILE * stream, CR2_IFD * ifd, CR2_Image_Info * buffer
 					tmp_IFD = (CR2_IFD*)malloc(sizeof(CR2_IFD));
 					if (CR2_get_IFD(stream, tmp_IFD, ifd->dir_entries[i].value) == 0) {
 						fprintf(stderr, "[ERROR-CR2_get_image_info]\n");
+						free(tmp_IFD);
 						return false;
 					}
 					/* recursive */
@@ -768,29 +1657,47 @@ boolean CR2_get_image_info(FILE * stream, CR2_IFD * ifd, CR2_Image_Info * buffer
 				break;
 
 				case CR2_TAG_FOCAL_LENGTH:
-					fseek(stream, ifd->dir_entries[i].value+2, SEEK_SET);
-					buffer->focal_length = get_ushort(stream);
+					/* FocalType, FocalLength, FocalPlaneXSize, FocalPlaneYSize */
+					if (ifd->dir_entries[i].number_of_value < 2) {
+						break;
+					}
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					buffer->focal_length = CR2_value_int(values, ifd->dir_entries[i].tag_type, 1);
+					free(values);
 				break;
 								
 				case CR2_TAG_EXPOSURE_TIME:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					values = get_urational(stream);
-					sprintf(tmp_string, "%d/%ds", values[0], values[1]);
-					buffer->exposure_time = (char*)malloc(strlen(tmp_string)*sizeof(char));
-					strcpy(buffer->exposure_time, tmp_string);
+					if (ifd->dir_entries[i].tag_type != TIFF_TYPE_RATIONAL) {
+						break;
+					}
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					if (values != NULL) {
+						buffer->exposure_time_rational[0] = values[0];
+						buffer->exposure_time_rational[1] = values[1];
+						sprintf(tmp_string, "%d/%ds", values[0], values[1]);
+						buffer->exposure_time = strdup(tmp_string);
+						free(values);
+					}
 				break;
 				
 				case CR2_TAG_F_NUMBER:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					values = get_urational(stream);
-					sprintf(tmp_string, "f/%.1f", (float)values[0]/values[1]);
-					buffer->f_number = (char*)malloc(strlen(tmp_string)*sizeof(char));
-					strcpy(buffer->f_number, tmp_string);
+					if (ifd->dir_entries[i].tag_type != TIFF_TYPE_RATIONAL) {
+						break;
+					}
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					if (values != NULL) {
+						buffer->f_number_rational[0] = values[0];
+						buffer->f_number_rational[1] = values[1];
+						sprintf(tmp_string, "f/%.1f", (values[1] != 0) ? (float)values[0]/values[1] : 0);
+						buffer->f_number = strdup(tmp_string);
+						free(values);
+					}
 				break;
 								
 				case CR2_TAG_COLOR_SPACE:
-					fseek(stream, ifd->dir_entries[i].value, SEEK_SET);
-					buffer->color_space = (get_ushort(stream) == 1) ? "sRGB" : "Adobe RGB";
+					values = CR2_get_entry_values(stream, &ifd->dir_entries[i]);
+					buffer->color_space = (CR2_value_int(values, ifd->dir_entries[i].tag_type, 0) == 1) ? "sRGB" : "Adobe RGB";
+					free(values);
 				break;
 			}
 		}
@@ -829,3 +1736,3271 @@ boolean CR2_print_image_info(FILE * stream, CR2_Image_Info * info) {
 	
 	return false;
 }
+
+/**
+ * CR2_destroy_image_info
+ * It frees the memory allocated for the information
+ * (color_space is a constant string).
+ */
+boolean CR2_destroy_image_info(CR2_Image_Info * info) {
+	if (info != NULL) {
+		free(info->exposure_time);
+		free(info->owner_name);
+		free(info->lens_model);
+		free(info->date_time);
+		free(info->f_number);
+		free(info->model);
+		free(info);
+		
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * CR2_find_entry
+ * Params:
+ *   1. the ifd section where the tag is searched
+ *   2. the tag ID to search
+ * Return:
+ *   The first directory entry with that tag ID, NULL if there isn't.
+ */
+CR2_IFD_Directory_Entry * CR2_find_entry(CR2_IFD * ifd, u16 tag_ID) {
+	if (ifd != NULL) {
+		u32 i;
+		
+		for (i = 0; i < ifd->dir_entries_length; i++) {
+			if (ifd->dir_entries[i].tag_ID == tag_ID) {
+				return &ifd->dir_entries[i];
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+/**
+ * CR2_get_ushort_array
+ * Params:
+ *   1. the stream of the .cr2 file
+ *   2. the offset of the first element
+ *   3. the number of elements to read
+ * Return:
+ *   An array of unsigned short that must be freed by the caller,
+ *   NULL if something goes wrong.
+ */
+u16* CR2_get_ushort_array(FILE * stream, u32 offset, u32 count) {
+	u16 * values;
+	u32 i;
+	
+	if (stream == NULL || count == 0) {
+		return NULL;
+	}
+	
+	if (fseek(stream, offset, SEEK_SET) != 0) {
+		perror("[ERROR-fseek]");
+		return NULL;
+	}
+	
+	values = (u16*)malloc(sizeof(u16)*count);
+	if (fread(values, sizeof(u16), count, stream) != count) {
+		perror("[ERROR-fread]");
+		free(values);
+		return NULL;
+	}
+	
+	if (IS_BIG_ENDIAN) {
+		for (i = 0; i < count; i++) {
+			values[i] = WORD_TO_LITTLE_ENDIAN(values[i]);
+		}
+	}
+	
+	return values;
+}
+
+/**
+ * CR2_get_makernote
+ * Params:
+ *   1. the stream of the .cr2 file
+ *   2. the IFD#0 section, that points to the EXIF section
+ *   3. the buffer used for storing the MakerNote section
+ * Return:
+ *   False if the EXIF or the MakerNote section cannot be read.
+ */
+boolean CR2_get_makernote(FILE * stream, CR2_IFD * ifd, CR2_IFD * makernote) {
+	CR2_IFD_Directory_Entry * entry;
+	CR2_IFD * exif;
+	
+	if (stream == NULL || ifd == NULL || makernote == NULL) {
+		return false;
+	}
+	
+	entry = CR2_find_entry(ifd, CR2_TAG_EXIF);
+	if (entry == NULL) {
+		return false;
+	}
+	
+	exif = (CR2_IFD*)malloc(sizeof(CR2_IFD));
+	if (CR2_get_IFD(stream, exif, entry->value) == 0) {
+		free(exif);
+		return false;
+	}
+	
+	entry = CR2_find_entry(exif, CR2_TAG_MAKERNOTE);
+	if (entry == NULL || CR2_get_IFD(stream, makernote, entry->value) == 0) {
+		CR2_destroy_IFD(exif);
+		return false;
+	}
+	
+	CR2_destroy_IFD(exif);
+	return true;
+}
+
+/**
+ * CR2_get_strip
+ * Params:
+ *   1. the ifd section that contains the strip
+ *   2. the buffer used for storing the offset of the strip
+ *   3. the buffer used for storing the length of the strip
+ * Return:
+ *   False if the ifd doesn't contain a strip.
+ */
+boolean CR2_get_strip(CR2_IFD * ifd, u32 * offset, u32 * length) {
+	CR2_IFD_Directory_Entry *strip_offset, *strip_byte_count;
+	
+	strip_offset = CR2_find_entry(ifd, CR2_TAG_STRIP_OFFSETS);
+	strip_byte_count = CR2_find_entry(ifd, CR2_TAG_STRIP_BYTE_COUNTS);
+	if (strip_offset == NULL || strip_byte_count == NULL || offset == NULL || length == NULL) {
+		return false;
+	}
+	
+	*offset = strip_offset->value;
+	*length = strip_byte_count->value;
+	return true;
+}
+
+/**
+ * build_huffman_table
+ * It builds the lookup table of a DHT segment from the number of codes
+ * of each length (16 values) and the symbols sorted by code length.
+ * It returns false if the code lengths are not valid.
+ */
+static boolean build_huffman_table(const u8 * counts, const u8 * symbols, CR2_Huffman_Table * table) {
+	u32 code = 0;
+	u32 length, i, k = 0;
+	
+	memset(table->lookup, 0x00, sizeof(table->lookup));
+	for (length = 1; length <= 16; length++) {
+		for (i = 0; i < counts[length-1]; i++) {
+			u32 first = code << (16 - length);
+			u32 last = first + (1 << (16 - length));
+			
+			if (code >= (1u << length)) {
+				return false;
+			}
+			while (first < last) {
+				table->lookup[first++] = (length << 8) | symbols[k];
+			}
+			k++;
+			code++;
+		}
+		code <<= 1;
+	}
+	
+	return true;
+}
+
+/**
+ * bit_reader_fill
+ * It loads bytes into the bit buffer until it contains at least 25 bits.
+ */
+static inline void bit_reader_fill(CR2_Bit_Reader * reader) {
+	while (reader->bit_count <= 24) {
+		u8 byte = 0;
+		
+		if (reader->position < reader->length) {
+			byte = reader->data[reader->position];
+			if (byte != 0xFF) {
+				reader->position++;
+			}
+			else if (reader->position + 1 < reader->length && reader->data[reader->position+1] == 0x00) {
+				reader->position += 2;
+			}
+			else {
+				/* marker: the entropy coded segment is over */
+				byte = 0;
+			}
+		}
+		reader->bit_buffer |= (u32)byte << (24 - reader->bit_count);
+		reader->bit_count += 8;
+	}
+}
+
+/**
+ * decode_difference
+ * It reads a Huffman coded difference (ITU T.81, section H.1.2.2).
+ */
+static inline s32 decode_difference(CR2_Bit_Reader * reader, CR2_Huffman_Table * table) {
+	u16 code;
+	u32 length;
+	s32 difference;
+	
+	bit_reader_fill(reader);
+	code = table->lookup[reader->bit_buffer >> 16];
+	length = code >> 8;
+	if (length == 0) {
+		reader->corrupted = true;
+		return 0;
+	}
+	reader->bit_buffer <<= length;
+	reader->bit_count -= length;
+	
+	length = code & 0xFF;
+	if (length == 0) {
+		return 0;
+	}
+	if (length >= 16) {
+		return 32768;
+	}
+	
+	bit_reader_fill(reader);
+	difference = reader->bit_buffer >> (32 - length);
+	reader->bit_buffer <<= length;
+	reader->bit_count -= length;
+	if (difference < (1 << (length - 1))) {
+		difference += 1 - (1 << length);
+	}
+	
+	return difference;
+}
+
+/**
+ * CR2_decode_lossless_jpeg
+ * Params:
+ *   1. the lossless jpeg stored in the IFD#3 strip
+ *   2. the length of the strip
+ *   3. the CR2 slices (number of slices, slice width, last slice width)
+ *      or NULL if the image isn't sliced
+ *   4. the buffer used for storing the decoded image
+ * Return:
+ *   False if the jpeg isn't valid.
+ *
+ * The jpeg rows are written one after another in vertical slices of
+ * the raw image, so each decoded sample is stored directly at its
+ * position in the raw image.
+ */
+boolean CR2_decode_lossless_jpeg(const u8 * data, u32 length, u16 * slices, CR2_Raw_Image * raw) {
+	CR2_Huffman_Table *tables[4] = {NULL, NULL, NULL, NULL};
+	CR2_Huffman_Table *component_tables[4];
+	u8 component_table_ids[4] = {0, 0, 0, 0};
+	u8 precision = 0, components = 0, predictor = 1, point_transform = 0;
+	u16 jpeg_height = 0, jpeg_width = 0;
+	u32 position = 2;
+	boolean scan_found = false;
+	boolean no_errors = true;
+	CR2_Bit_Reader reader;
+	u16 *previous_row, *current_row, *tmp_row;
+	u32 row_width, raw_width, raw_height;
+	u32 slice, slice_base, slice_width, slice_row, slice_col;
+	u32 row, col, c, i;
+	
+	if (data == NULL || raw == NULL || length < 4 || data[0] != 0xFF || data[1] != JPEG_MARKER_SOI) {
+		fprintf(stderr, "[ERROR-CR2_decode_lossless_jpeg] SOI not found\n");
+		return false;
+	}
+	
+	/* read the segments up to the start of scan */
+	while (!scan_found && no_errors && position + 4 <= length) {
+		const u8 *segment = data + position + 4;
+		u32 segment_length;
+		u8 marker;
+		
+		if (data[position] != 0xFF) {
+			no_errors = false;
+			break;
+		}
+		marker = data[position+1];
+		if (marker == 0xFF) {
+			position++;
+			continue;
+		}
+		segment_length = (data[position+2] << 8) | data[position+3];
+		if (segment_length < 2 || position + 2 + segment_length > length) {
+			no_errors = false;
+			break;
+		}
+		
+		switch (marker) {
+			case JPEG_MARKER_DHT:
+				i = 0;
+				while (no_errors && i + 17 <= segment_length - 2) {
+					u8 id = segment[i] & 0x0F;
+					u32 symbols = 0, k;
+					
+					for (k = 0; k < 16; k++) {
+						symbols += segment[i+1+k];
+					}
+					if (id > 3 || i + 17 + symbols > segment_length - 2) {
+						no_errors = false;
+						break;
+					}
+					if (tables[id] == NULL) {
+						tables[id] = (CR2_Huffman_Table*)malloc(sizeof(CR2_Huffman_Table));
+					}
+					no_errors = build_huffman_table(segment + i + 1, segment + i + 17, tables[id]);
+					i += 17 + symbols;
+				}
+			break;
+			
+			case JPEG_MARKER_SOF3:
+				if (segment_length < 8) {
+					no_errors = false;
+					break;
+				}
+				precision = segment[0];
+				jpeg_height = (segment[1] << 8) | segment[2];
+				jpeg_width = (segment[3] << 8) | segment[4];
+				components = segment[5];
+				if (components == 0 || components > 4) {
+					no_errors = false;
+				}
+			break;
+			
+			case JPEG_MARKER_SOS:
+				if (segment_length < (u32)(6 + 2*segment[0]) || segment[0] != components) {
+					no_errors = false;
+					break;
+				}
+				for (c = 0; c < components; c++) {
+					component_table_ids[c] = segment[2+2*c] >> 4;
+				}
+				predictor = segment[1+2*components];
+				point_transform = segment[3+2*components] & 0x0F;
+				scan_found = true;
+			break;
+		}
+		position += 2 + segment_length;
+	}
+	
+	if (no_errors) {
+		no_errors = scan_found && components >= 1 && components <= 4 && jpeg_width > 0 && jpeg_height > 0 &&
+					precision >= 2 && precision <= 16 && point_transform < precision &&
+					predictor >= 1 && predictor <= 7;
+		for (c = 0; no_errors && c < components; c++) {
+			component_tables[c] = (component_table_ids[c] < 4) ? tables[component_table_ids[c]] : NULL;
+			no_errors = (component_tables[c] != NULL);
+		}
+	}
+	
+	row_width = jpeg_width * components;
+	raw_width = (slices != NULL) ? (u32)slices[0]*slices[1] + slices[2] : row_width;
+	if (no_errors && (raw_width == 0 || ((u64)row_width * jpeg_height) % raw_width != 0)) {
+		no_errors = false;
+	}
+	if (!no_errors) {
+		fprintf(stderr, "[ERROR-CR2_decode_lossless_jpeg] Invalid or unsupported jpeg\n");
+		for (i = 0; i < 4; i++) {
+			free(tables[i]);
+		}
+		return false;
+	}
+	raw_height = ((u64)row_width * jpeg_height) / raw_width;
+	
+	raw->width = raw_width;
+	raw->height = raw_height;
+	raw->bits = precision;
+	raw->data = (u16*)malloc(sizeof(u16)*(u64)raw_width*raw_height);
+	previous_row = (u16*)calloc(row_width, sizeof(u16));
+	current_row = (u16*)malloc(sizeof(u16)*row_width);
+	if (raw->data == NULL || previous_row == NULL || current_row == NULL) {
+		perror("[ERROR-CR2_decode_lossless_jpeg]");
+		free(raw->data);
+		raw->data = NULL;
+		free(previous_row);
+		free(current_row);
+		for (i = 0; i < 4; i++) {
+			free(tables[i]);
+		}
+		return false;
+	}
+	
+	reader.data = data;
+	reader.length = length;
+	reader.position = position;
+	reader.bit_buffer = 0;
+	reader.bit_count = 0;
+	reader.corrupted = false;
+	
+	slice = 0;
+	slice_base = 0;
+	slice_width = (slices != NULL && slices[0] > 0) ? slices[1] : raw_width;
+	slice_row = 0;
+	slice_col = 0;
+	
+	for (row = 0; row < jpeg_height && !reader.corrupted; row++) {
+		for (col = 0; col < jpeg_width; col++) {
+			for (c = 0; c < components; c++) {
+				u32 k = col*components + c;
+				s32 prediction;
+				u16 sample;
+				
+				if (col == 0) {
+					prediction = (row == 0) ? (s32)(1 << (precision - point_transform - 1)) : (s32)previous_row[k];
+				}
+				else if (row == 0) {
+					prediction = current_row[k-components];
+				}
+				else {
+					s32 ra = current_row[k-components];
+					s32 rb = previous_row[k];
+					s32 rc = previous_row[k-components];
+					
+					switch (predictor) {
+						case 1:  prediction = ra;                   break;
+						case 2:  prediction = rb;                   break;
+						case 3:  prediction = rc;                   break;
+						case 4:  prediction = ra + rb - rc;         break;
+						case 5:  prediction = ra + ((rb - rc) >> 1); break;
+						case 6:  prediction = rb + ((ra - rc) >> 1); break;
+						default: prediction = (ra + rb) >> 1;       break;
+					}
+				}
+				sample = (u16)(prediction + decode_difference(&reader, component_tables[c]));
+				current_row[k] = sample;
+				raw->data[slice_row*raw_width + slice_base + slice_col] = sample;
+				
+				/* move to the next position of the current slice */
+				if (++slice_col == slice_width) {
+					slice_col = 0;
+					if (++slice_row == raw_height) {
+						slice_row = 0;
+						slice_base += slice_width;
+						slice++;
+						slice_width = (slices == NULL) ? raw_width : (slice < slices[0]) ? slices[1] : slices[2];
+					}
+				}
+			}
+		}
+		tmp_row = previous_row;
+		previous_row = current_row;
+		current_row = tmp_row;
+	}
+	
+	free(previous_row);
+	free(current_row);
+	for (i = 0; i < 4; i++) {
+		free(tables[i]);
+	}
+	
+	if (reader.corrupted) {
+		fprintf(stderr, "[ERROR-CR2_decode_lossless_jpeg] Invalid Huffman code at row %d\n", row);
+		free(raw->data);
+		raw->data = NULL;
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_get_raw_image
+ * Params:
+ *   1. the stream of the .cr2 file
+ *   2. the IFD#3 section, that contains the raw data
+ *   3. the buffer used for storing the decoded raw image
+ * Return:
+ *   False if the raw data cannot be read or decoded.
+ *   The raw image must be freed with CR2_destroy_raw_image.
+ */
+boolean CR2_get_raw_image(FILE * stream, CR2_IFD * raw_ifd, CR2_Raw_Image * raw) {
+	CR2_IFD_Directory_Entry *slice_entry;
+	u32 strip_offset, strip_length;
+	u16 *slices = NULL;
+	u8 *strip;
+	boolean decoded;
+	
+	if (stream == NULL || raw_ifd == NULL || raw == NULL) {
+		return false;
+	}
+	
+	if (!CR2_get_strip(raw_ifd, &strip_offset, &strip_length)) {
+		fprintf(stderr, "[ERROR-CR2_get_raw_image] Raw strip not found\n");
+		return false;
+	}
+	slice_entry = CR2_find_entry(raw_ifd, CR2_TAG_CR2_SLICE);
+	
+	if (slice_entry != NULL && slice_entry->number_of_value == 3) {
+		slices = CR2_get_ushort_array(stream, slice_entry->value, 3);
+	}
+	
+	if (fseek(stream, strip_offset, SEEK_SET) != 0) {
+		perror("[ERROR-fseek]");
+		free(slices);
+		return false;
+	}
+	strip = (u8*)malloc(strip_length);
+	if (strip == NULL || fread(strip, 1, strip_length, stream) != strip_length) {
+		perror("[ERROR-fread]");
+		free(strip);
+		free(slices);
+		return false;
+	}
+	
+	decoded = CR2_decode_lossless_jpeg(strip, strip_length, slices, raw);
+	
+	free(strip);
+	free(slices);
+	return decoded;
+}
+
+/**
+ * CR2_destroy_raw_image
+ * It frees the samples of the raw image.
+ */
+boolean CR2_destroy_raw_image(CR2_Raw_Image * raw) {
+	if (raw != NULL) {
+		free(raw->data);
+		raw->data = NULL;
+		
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * CR2_get_raw_params
+ * Params:
+ *   1. the stream of the .cr2 file
+ *   2. the IFD#0 section
+ *   3. the decoded raw image
+ *   4. the buffer used for storing the parameters
+ * Return:
+ *   False if the params are not valid.
+ *
+ * The active area comes from the MakerNote SensorInfo, the white balance
+ * from the ColorData (WB_RGGBLevelsAsShot, whose position depends on the
+ * ColorData version, i.e. on its length, and is not applied with unknown
+ * versions) and the black level is the mean
+ * of the masked pixels on the left of the active area.
+ * The white level is the ColorData SpecularWhiteLevel when the version has
+ * it, the maximum code of the raw data otherwise.
+ * If the MakerNote is missing, the whole image is used with black level 0
+ * and without white balance.
+ */
+boolean CR2_get_raw_params(FILE * stream, CR2_IFD * ifd, CR2_Raw_Image * raw, CR2_Raw_Params * params) {
+	CR2_Tag_Tree *tree, *makernote;
+	CR2_Tag *tag;
+	s32 borders[4], levels[4], white_level;
+	boolean found = false;
+	u32 wb_index, white_level_index, i;
+	
+	if (stream == NULL || ifd == NULL || raw == NULL || raw->data == NULL || params == NULL) {
+		return false;
+	}
+	
+	params->left_border = 0;
+	params->top_border = 0;
+	params->right_border = raw->width - 1;
+	params->bottom_border = raw->height - 1;
+	params->black_level = 0;
+	params->white_level = (1 << raw->bits) - 1;
+	for (i = 0; i < 4; i++) {
+		params->wb[i] = 1.0;
+	}
+	
+	/* only the SensorInfo and ColorData arrays of the MakerNote are read */
+	tree = CR2_tag_tree_open(stream, ifd->offset);
+	makernote = CR2_tag_subtree(CR2_tag_subtree(tree, CR2_TAG_EXIF), CR2_TAG_MAKERNOTE);
+	if (makernote == NULL) {
+		CR2_tag_tree_destroy(tree);
+		return true;
+	}
+	
+	for (i = 0; i < 4; i++) {
+		found = CR2_makernote_field(makernote, CR2_TAG_SENSOR_INFO, 5 + i, &borders[i]) && borders[i] >= 0;
+		if (!found) {
+			break;
+		}
+	}
+	if (found && borders[0] < borders[2] && borders[2] < (s32)raw->width &&
+		borders[1] < borders[3] && borders[3] < (s32)raw->height) {
+		params->left_border = borders[0];
+		params->top_border = borders[1];
+		params->right_border = borders[2];
+		params->bottom_border = borders[3];
+	}
+	
+	/* the white balance is left to 1.0 with an unknown ColorData version */
+	tag = CR2_tag_find(makernote, CR2_TAG_COLOR_DATA);
+	wb_index = (tag != NULL) ? CR2_color_data_WB_index(tag->entry.number_of_value) : 0;
+	if (wb_index != 0) {
+		for (i = 0; i < 4; i++) {
+			found = CR2_makernote_field(makernote, CR2_TAG_COLOR_DATA, wb_index + i, &levels[i]) && levels[i] > 0;
+			if (!found) {
+				break;
+			}
+		}
+		if (found) {
+			float green = (levels[1] + levels[2]) / 2.0;
+			
+			for (i = 0; i < 4; i++) {
+				params->wb[i] = levels[i] / green;
+			}
+		}
+		
+		/* the sensor saturates below the maximum code */
+		white_level_index = CR2_color_data_white_level_index(tag->entry.number_of_value);
+		if (white_level_index != 0 &&
+			CR2_makernote_field(makernote, CR2_TAG_COLOR_DATA, white_level_index, &white_level) &&
+			white_level > 0 && white_level < params->white_level) {
+			params->white_level = white_level;
+		}
+	}
+	CR2_tag_tree_destroy(tree);
+	
+	/* black level from the masked left border */
+	if (params->left_border > 0) {
+		u64 sum = 0;
+		u32 row, col;
+		
+		for (row = params->top_border; row <= params->bottom_border; row++) {
+			for (col = 0; col < params->left_border; col++) {
+				sum += raw->data[row*raw->width + col];
+			}
+		}
+		params->black_level = sum / ((u64)params->left_border * (params->bottom_border - params->top_border + 1));
+	}
+	
+	return params->black_level < params->white_level;
+}
+
+/**
+ * band_thread
+ * Thread body used by CR2_run_bands.
+ */
+static void *band_thread(void *argument) {
+	CR2_Band *band = (CR2_Band*)argument;
+	
+	band->function(band->context, band->first_row, band->last_row, band->band_id);
+	return NULL;
+}
+
+/**
+ * CR2_number_of_bands
+ * Return:
+ *   The number of bands (and threads) used by CR2_run_bands
+ *   for an image with that number of rows.
+ */
+u32 CR2_number_of_bands(u32 rows) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 bands = (cpus < 1) ? 1 : (cpus > MAX_THREADS) ? MAX_THREADS : (u32)cpus;
+	
+	return (rows < bands) ? rows : bands;
+}
+
+/**
+ * CR2_run_bands
+ * Params:
+ *   1. the function to execute on every band
+ *   2. the context passed to the function
+ *   3. the number of rows to split
+ * Return:
+ *   The number of bands used.
+ *
+ * It splits the rows in one band per CPU and processes them in parallel.
+ * The first band is processed by the calling thread.
+ */
+u32 CR2_run_bands(CR2_Band_Function function, void * context, u32 rows) {
+	CR2_Band bands[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	boolean started[MAX_THREADS];
+	u32 number_of_bands = CR2_number_of_bands(rows);
+	u32 i;
+	
+	for (i = 0; i < number_of_bands; i++) {
+		bands[i].function = function;
+		bands[i].context = context;
+		bands[i].first_row = (u64)rows * i / number_of_bands;
+		bands[i].last_row = (u64)rows * (i + 1) / number_of_bands;
+		bands[i].band_id = i;
+		started[i] = false;
+	}
+	
+	for (i = 1; i < number_of_bands; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, band_thread, &bands[i]) == 0);
+	}
+	if (number_of_bands > 0) {
+		band_thread(&bands[0]);
+	}
+	for (i = 1; i < number_of_bands; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		else {
+			band_thread(&bands[i]);
+		}
+	}
+	
+	return number_of_bands;
+}
+
+#ifdef __SSE2__
+/**
+ * render_row_SSE2
+ * It renders 8 pixels at a time: every 128 bit load contains 4 Bayer
+ * pairs, so the even samples are in the low half of each 32 bit lane
+ * and the odd samples are in the high half.
+ * It returns the number of pixels rendered.
+ */
+static u32 render_row_SSE2(CR2_Render_Context * context, const u16 * top, const u16 * bottom, u8 * out, u32 width) {
+	const __m128i black = _mm_set1_epi16(context->black_level);
+	const __m128i low_mask = _mm_set1_epi32(0xFFFF);
+	const __m128 scale_r = _mm_set1_ps(context->scale[0]);
+	const __m128 scale_g = _mm_set1_ps(context->scale[1]);
+	const __m128 scale_b = _mm_set1_ps(context->scale[2]);
+	const __m128 max_index = _mm_set1_ps(PREVIEW_LUT_SIZE - 1);
+	int indexes[3][8];
+	u32 x, i, half;
+	
+	for (x = 0; x + 8 <= width; x += 8) {
+		for (half = 0; half < 2; half++) {
+			__m128i rg = _mm_subs_epu16(_mm_loadu_si128((const __m128i*)(top + 2*x + 8*half)), black);
+			__m128i gb = _mm_subs_epu16(_mm_loadu_si128((const __m128i*)(bottom + 2*x + 8*half)), black);
+			__m128i r = _mm_and_si128(rg, low_mask);
+			__m128i g = _mm_srli_epi32(_mm_add_epi32(_mm_srli_epi32(rg, 16), _mm_and_si128(gb, low_mask)), 1);
+			__m128i b = _mm_srli_epi32(gb, 16);
+			
+			_mm_storeu_si128((__m128i*)&indexes[0][4*half],
+							 _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(r), scale_r), max_index)));
+			_mm_storeu_si128((__m128i*)&indexes[1][4*half],
+							 _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(g), scale_g), max_index)));
+			_mm_storeu_si128((__m128i*)&indexes[2][4*half],
+							 _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(b), scale_b), max_index)));
+		}
+		for (i = 0; i < 8; i++) {
+			out[3*(x+i)]   = context->lut[indexes[0][i]];
+			out[3*(x+i)+1] = context->lut[indexes[1][i]];
+			out[3*(x+i)+2] = context->lut[indexes[2][i]];
+		}
+	}
+	
+	return x;
+}
+#endif
+
+/**
+ * render_index
+ * Scalar version of the conversion from a raw value to a LUT index.
+ */
+static inline u32 render_index(u32 value, u16 black_level, float scale) {
+	float index = (value > black_level) ? (value - black_level) * scale : 0;
+	
+	return (index < PREVIEW_LUT_SIZE - 1) ? (u32)index : PREVIEW_LUT_SIZE - 1;
+}
+
+/**
+ * render_band
+ * It renders the preview rows [first_row, last_row):
+ * every output pixel comes from a RGGB quad of the raw image.
+ */
+static void render_band(void * argument, u32 first_row, u32 last_row, u32 band_id) {
+	CR2_Render_Context *context = (CR2_Render_Context*)argument;
+	CR2_Raw_Image *raw = context->raw;
+	CR2_Preview *preview = context->preview;
+	u32 y, x;
+	
+	(void)band_id;
+	for (y = first_row; y < last_row; y++) {
+		const u16 *top = raw->data + (context->top + 2*y)*raw->width + context->left;
+		const u16 *bottom = top + raw->width;
+		u8 *out = preview->data + y*preview->width*3;
+		
+		x = 0;
+#ifdef __SSE2__
+		x = render_row_SSE2(context, top, bottom, out, preview->width);
+#endif
+		for (; x < preview->width; x++) {
+			u32 g1 = (top[2*x+1] > context->black_level) ? top[2*x+1] - context->black_level : 0;
+			u32 g2 = (bottom[2*x] > context->black_level) ? bottom[2*x] - context->black_level : 0;
+			
+			out[3*x]   = context->lut[render_index(top[2*x], context->black_level, context->scale[0])];
+			out[3*x+1] = context->lut[render_index((g1 + g2) >> 1, 0, context->scale[1])];
+			out[3*x+2] = context->lut[render_index(bottom[2*x+1], context->black_level, context->scale[2])];
+		}
+	}
+}
+
+/**
+ * CR2_render_half_size
+ * Params:
+ *   1. the decoded raw image
+ *   2. the params of the raw image
+ *   3. the buffer used for storing the preview
+ * Return:
+ *   False if something goes wrong.
+ *
+ * It bins every 2x2 RGGB quad of the active area into one RGB pixel,
+ * after subtracting the black level and applying the white balance,
+ * and then applies a 2.2 gamma. Rows are rendered in parallel.
+ * The preview data must be freed by the caller.
+ */
+boolean CR2_render_half_size(CR2_Raw_Image * raw, CR2_Raw_Params * params, CR2_Preview * preview) {
+	CR2_Render_Context *context;
+	float range;
+	u32 i;
+	
+	if (raw == NULL || raw->data == NULL || params == NULL || preview == NULL) {
+		return false;
+	}
+	
+	context = (CR2_Render_Context*)malloc(sizeof(CR2_Render_Context));
+	context->raw = raw;
+	context->preview = preview;
+	context->left = params->left_border & ~1;
+	context->top = params->top_border & ~1;
+	context->black_level = params->black_level;
+	
+	range = params->white_level - params->black_level;
+	context->scale[0] = (PREVIEW_LUT_SIZE - 1) * params->wb[0] / range;
+	context->scale[1] = (PREVIEW_LUT_SIZE - 1) * (params->wb[1] + params->wb[2]) / 2 / range;
+	context->scale[2] = (PREVIEW_LUT_SIZE - 1) * params->wb[3] / range;
+	for (i = 0; i < PREVIEW_LUT_SIZE; i++) {
+		context->lut[i] = (u8)(255.0 * pow((double)i / (PREVIEW_LUT_SIZE - 1), 1 / 2.2) + 0.5);
+	}
+	
+	preview->width = (params->right_border + 1 - context->left) / 2;
+	preview->height = (params->bottom_border + 1 - context->top) / 2;
+	preview->data = (u8*)malloc(3*preview->width*preview->height);
+	if (preview->data == NULL) {
+		free(context);
+		return false;
+	}
+	
+	CR2_run_bands(render_band, context, preview->height);
+	
+	free(context);
+	return true;
+}
+
+/**
+ * CR2_write_PPM
+ * Params:
+ *   1. the path of the output file
+ *   2. the preview to write
+ * Return:
+ *   False if something goes wrong.
+ *
+ * It writes the preview as a binary PPM (P6) file.
+ */
+boolean CR2_write_PPM(const char * path, CR2_Preview * preview) {
+	FILE *file;
+	u32 size;
+	
+	if (path == NULL || preview == NULL || preview->data == NULL) {
+		return false;
+	}
+	
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		perror("[ERROR-fopen]");
+		return false;
+	}
+	
+	size = 3*preview->width*preview->height;
+	fprintf(file, "P6\n%d %d\n255\n", preview->width, preview->height);
+	if (fwrite(preview->data, 1, size, file) != size) {
+		perror("[ERROR-fwrite]");
+		fclose(file);
+		return false;
+	}
+	
+	return fclose(file) == 0;
+}
+
+#ifdef HAVE_AVX2_TARGET
+/**
+ * black_row_AVX2
+ * It adds to sum and sum_squares the first width samples of the row,
+ * 16 at a time. The samples must be lower than 0x8000 (bits <= 15),
+ * because _mm256_madd_epi16 works on signed words.
+ * It returns the number of samples processed.
+ */
+__attribute__((target("avx2")))
+static u32 black_row_AVX2(const u16 * row, u32 width, u64 * sum, u64 * sum_squares) {
+	const __m256i ones = _mm256_set1_epi16(1);
+	__m256i sums = _mm256_setzero_si256();
+	__m256i squares = _mm256_setzero_si256();
+	u64 lanes[4];
+	u32 x, i;
+	
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i values = _mm256_loadu_si256((const __m256i*)(row + x));
+		__m256i pairs = _mm256_madd_epi16(values, values);
+		
+		sums = _mm256_add_epi32(sums, _mm256_madd_epi16(values, ones));
+		squares = _mm256_add_epi64(squares, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pairs)));
+		squares = _mm256_add_epi64(squares, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pairs, 1)));
+	}
+	
+	sums = _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(sums)),
+							_mm256_cvtepu32_epi64(_mm256_extracti128_si256(sums, 1)));
+	_mm256_storeu_si256((__m256i*)lanes, sums);
+	for (i = 0; i < 4; i++) {
+		*sum += lanes[i];
+	}
+	_mm256_storeu_si256((__m256i*)lanes, squares);
+	for (i = 0; i < 4; i++) {
+		*sum_squares += lanes[i];
+	}
+	
+	return x;
+}
+#endif
+
+/**
+ * stats_band
+ * It computes the statistics of the raw rows [top + first_row, top + last_row)
+ * into the partial of the band. The histograms are filled with scalar code,
+ * because there isn't a scatter-add instruction in AVX2.
+ */
+static void stats_band(void * argument, u32 first_row, u32 last_row, u32 band_id) {
+	CR2_Stats_Context *context = (CR2_Stats_Context*)argument;
+	CR2_Stats_Partial *partial = &context->partials[band_id];
+	CR2_Raw_Image *raw = context->raw;
+	CR2_Raw_Params *params = context->params;
+	u32 histogram_mask = (1 << raw->bits) - 1;
+	u32 y, x;
+	
+	for (y = first_row; y < last_row; y++) {
+		const u16 *row = raw->data + (context->top + y)*raw->width;
+		u32 *even = partial->histograms[(y & 1) ? 2 : 0];
+		u32 *odd = partial->histograms[(y & 1) ? 3 : 1];
+		
+		/* R G R G ... or G B G B ... */
+		for (x = context->left; x + 1 <= params->right_border; x += 2) {
+			even[row[x] & histogram_mask]++;
+			odd[row[x+1] & histogram_mask]++;
+		}
+		
+		/* masked black border */
+		x = 0;
+#ifdef HAVE_AVX2_TARGET
+		if (context->use_AVX2) {
+			x = black_row_AVX2(row, params->left_border, &partial->black_sum, &partial->black_sum_squares);
+		}
+#endif
+		for (; x < params->left_border; x++) {
+			partial->black_sum += row[x];
+			partial->black_sum_squares += (u64)row[x] * row[x];
+		}
+		partial->black_count += params->left_border;
+	}
+}
+
+/**
+ * CR2_get_raw_stats
+ * Params:
+ *   1. the decoded raw image
+ *   2. the params of the raw image
+ *   3. the buffer used for storing the statistics
+ * Return:
+ *   False if something goes wrong.
+ *
+ * Every thread fills its own histograms, that are merged at the end.
+ * The statistics must be freed with CR2_destroy_raw_stats.
+ */
+boolean CR2_get_raw_stats(CR2_Raw_Image * raw, CR2_Raw_Params * params, CR2_Raw_Stats * stats) {
+	CR2_Stats_Context *context;
+	u64 black_sum = 0, black_sum_squares = 0;
+	u32 rows, bands, band, c, v;
+	
+	if (raw == NULL || raw->data == NULL || params == NULL || stats == NULL) {
+		return false;
+	}
+	
+	context = (CR2_Stats_Context*)malloc(sizeof(CR2_Stats_Context));
+	context->raw = raw;
+	context->params = params;
+	context->left = params->left_border & ~1;
+	context->top = params->top_border & ~1;
+	context->use_AVX2 = false;
+#ifdef HAVE_AVX2_TARGET
+	context->use_AVX2 = (raw->bits <= 15 && __builtin_cpu_supports("avx2"));
+#endif
+	
+	stats->histogram_size = 1 << raw->bits;
+	rows = params->bottom_border + 1 - context->top;
+	bands = CR2_number_of_bands(rows);
+	for (band = 0; band < bands; band++) {
+		for (c = 0; c < 4; c++) {
+			context->partials[band].histograms[c] = (u32*)calloc(stats->histogram_size, sizeof(u32));
+		}
+		context->partials[band].black_sum = 0;
+		context->partials[band].black_sum_squares = 0;
+		context->partials[band].black_count = 0;
+	}
+	
+	CR2_run_bands(stats_band, context, rows);
+	
+	/* merge the partials: the histograms of the first band are kept */
+	stats->black_count = 0;
+	for (c = 0; c < 4; c++) {
+		stats->histograms[c] = context->partials[0].histograms[c];
+	}
+	for (band = 0; band < bands; band++) {
+		for (c = 0; band > 0 && c < 4; c++) {
+			for (v = 0; v < stats->histogram_size; v++) {
+				stats->histograms[c][v] += context->partials[band].histograms[c][v];
+			}
+			free(context->partials[band].histograms[c]);
+		}
+		black_sum += context->partials[band].black_sum;
+		black_sum_squares += context->partials[band].black_sum_squares;
+		stats->black_count += context->partials[band].black_count;
+	}
+	free(context);
+	
+	stats->white_level = params->white_level;
+	for (c = 0; c < 4; c++) {
+		stats->clipped[c] = 0;
+		for (v = params->white_level; v < stats->histogram_size; v++) {
+			stats->clipped[c] += stats->histograms[c][v];
+		}
+	}
+	
+	stats->black_mean = 0;
+	stats->black_stddev = 0;
+	if (stats->black_count > 0) {
+		double variance;
+		
+		stats->black_mean = (double)black_sum / stats->black_count;
+		variance = (double)black_sum_squares / stats->black_count - stats->black_mean*stats->black_mean;
+		stats->black_stddev = (variance > 0) ? sqrt(variance) : 0;
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_print_raw_stats
+ * Params:
+ *   1. the stream where you want to print the statistics
+ *   2. the statistics to print
+ * Return:
+ *   False if something goes wrong, true instead.
+ *
+ * Only the non empty bins of the histograms are printed, as "value: count".
+ */
+boolean CR2_print_raw_stats(FILE * stream, CR2_Raw_Stats * stats) {
+	static const char *channels[4] = {"R", "G1", "G2", "B"};
+	
+	if (stream != NULL && stats != NULL) {
+		u32 c, v;
+		
+		fprintf(stream, "[Raw_Stats]\n");
+		fprintf(stream, "\tBlack mean:    %.2f\n", stats->black_mean);
+		fprintf(stream, "\tBlack stddev:  %.2f\n", stats->black_stddev);
+		fprintf(stream, "\tBlack pixels:  %llu\n", stats->black_count);
+		fprintf(stream, "\tWhite level:   %d\n", stats->white_level);
+		for (c = 0; c < 4; c++) {
+			fprintf(stream, "\tClipped %-2s:    %llu\n", channels[c], stats->clipped[c]);
+		}
+		for (c = 0; c < 4; c++) {
+			fprintf(stream, "\t[HISTOGRAM_%s]\n", channels[c]);
+			for (v = 0; v < stats->histogram_size; v++) {
+				if (stats->histograms[c][v] != 0) {
+					fprintf(stream, "\t\t%d: %d\n", v, stats->histograms[c][v]);
+				}
+			}
+			fprintf(stream, "\t[/HISTOGRAM_%s]\n", channels[c]);
+		}
+		fprintf(stream, "[/Raw_Stats]\n");
+		
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * CR2_destroy_raw_stats
+ * It frees the histograms of the statistics.
+ */
+boolean CR2_destroy_raw_stats(CR2_Raw_Stats * stats) {
+	if (stats != NULL) {
+		u32 c;
+		
+		for (c = 0; c < 4; c++) {
+			free(stats->histograms[c]);
+			stats->histograms[c] = NULL;
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define ROTATE_LEFT_64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/**
+ * XXH64_read64, XXH64_read32
+ * Little endian reads of unaligned data.
+ */
+static inline u64 XXH64_read64(const u8 * data) {
+	u64 value;
+	
+	memcpy(&value, data, sizeof(u64));
+	return value;
+}
+
+static inline u32 XXH64_read32(const u8 * data) {
+	u32 value;
+	
+	memcpy(&value, data, sizeof(u32));
+	return value;
+}
+
+static inline u64 XXH64_round(u64 accumulator, u64 input) {
+	accumulator += input * XXH_PRIME64_2;
+	accumulator = ROTATE_LEFT_64(accumulator, 31);
+	return accumulator * XXH_PRIME64_1;
+}
+
+static inline u64 XXH64_merge_round(u64 accumulator, u64 value) {
+	accumulator ^= XXH64_round(0, value);
+	return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * XXH64
+ * Params:
+ *   1. the data to hash
+ *   2. the length of the data
+ *   3. the seed
+ * Return:
+ *   The 64 bit xxHash of the data (XXH64 specification), a fast
+ *   non-cryptographic hash that consumes 32 bytes per iteration.
+ */
+u64 XXH64(const u8 * data, u64 length, u64 seed) {
+	CR2_XXH64_Context context;
+	
+	XXH64_init(&context, seed);
+	XXH64_update(&context, data, length);
+	return XXH64_final(&context);
+}
+
+/**
+ * XXH64_init
+ * It initializes a XXH64 context.
+ */
+void XXH64_init(CR2_XXH64_Context * context, u64 seed) {
+	context->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	context->v[1] = seed + XXH_PRIME64_2;
+	context->v[2] = seed;
+	context->v[3] = seed - XXH_PRIME64_1;
+	context->seed = seed;
+	context->length = 0;
+	context->buffer_length = 0;
+}
+
+/**
+ * XXH64_stripe
+ * It consumes a stripe of 32 bytes.
+ */
+static inline void XXH64_stripe(CR2_XXH64_Context * context, const u8 * data) {
+	context->v[0] = XXH64_round(context->v[0], XXH64_read64(data));
+	context->v[1] = XXH64_round(context->v[1], XXH64_read64(data + 8));
+	context->v[2] = XXH64_round(context->v[2], XXH64_read64(data + 16));
+	context->v[3] = XXH64_round(context->v[3], XXH64_read64(data + 24));
+}
+
+/**
+ * XXH64_update
+ * It adds data to the XXH64 computation. Whole stripes are processed
+ * directly from the data, without copying them.
+ */
+void XXH64_update(CR2_XXH64_Context * context, const u8 * data, u64 length) {
+	context->length += length;
+	
+	if (context->buffer_length > 0) {
+		u32 missing = 32 - context->buffer_length;
+		u32 copied = (length < missing) ? (u32)length : missing;
+		
+		memcpy(context->buffer + context->buffer_length, data, copied);
+		context->buffer_length += copied;
+		data += copied;
+		length -= copied;
+		if (context->buffer_length < 32) {
+			return;
+		}
+		XXH64_stripe(context, context->buffer);
+		context->buffer_length = 0;
+	}
+	
+	while (length >= 32) {
+		XXH64_stripe(context, data);
+		data += 32;
+		length -= 32;
+	}
+	
+	memcpy(context->buffer, data, length);
+	context->buffer_length = length;
+}
+
+/**
+ * XXH64_final
+ * Return:
+ *   The hash of all the data added to the context.
+ */
+u64 XXH64_final(CR2_XXH64_Context * context) {
+	const u8 *data = context->buffer;
+	const u8 *end = data + context->buffer_length;
+	u64 hash;
+	
+	if (context->length >= 32) {
+		hash = ROTATE_LEFT_64(context->v[0], 1) + ROTATE_LEFT_64(context->v[1], 7) +
+			   ROTATE_LEFT_64(context->v[2], 12) + ROTATE_LEFT_64(context->v[3], 18);
+		hash = XXH64_merge_round(hash, context->v[0]);
+		hash = XXH64_merge_round(hash, context->v[1]);
+		hash = XXH64_merge_round(hash, context->v[2]);
+		hash = XXH64_merge_round(hash, context->v[3]);
+	}
+	else {
+		hash = context->seed + XXH_PRIME64_5;
+	}
+	hash += context->length;
+	
+	while (data + 8 <= end) {
+		hash ^= XXH64_round(0, XXH64_read64(data));
+		hash = ROTATE_LEFT_64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		data += 8;
+	}
+	if (data + 4 <= end) {
+		hash ^= (u64)XXH64_read32(data) * XXH_PRIME64_1;
+		hash = ROTATE_LEFT_64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		data += 4;
+	}
+	while (data < end) {
+		hash ^= (*data) * XXH_PRIME64_5;
+		hash = ROTATE_LEFT_64(hash, 11) * XXH_PRIME64_1;
+		data++;
+	}
+	
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	
+	return hash;
+}
+
+#define ROTATE_RIGHT_32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static const u32 SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * SHA256_transform
+ * It processes a 64 bytes block.
+ */
+static void SHA256_transform(CR2_SHA256_Context * context, const u8 * block) {
+	u32 w[64];
+	u32 a, b, c, d, e, f, g, h;
+	u32 i;
+	
+	for (i = 0; i < 16; i++) {
+		w[i] = ((u32)block[4*i] << 24) | ((u32)block[4*i+1] << 16) | ((u32)block[4*i+2] << 8) | block[4*i+3];
+	}
+	for (i = 16; i < 64; i++) {
+		u32 s0 = ROTATE_RIGHT_32(w[i-15], 7) ^ ROTATE_RIGHT_32(w[i-15], 18) ^ (w[i-15] >> 3);
+		u32 s1 = ROTATE_RIGHT_32(w[i-2], 17) ^ ROTATE_RIGHT_32(w[i-2], 19) ^ (w[i-2] >> 10);
+		
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	
+	a = context->state[0];
+	b = context->state[1];
+	c = context->state[2];
+	d = context->state[3];
+	e = context->state[4];
+	f = context->state[5];
+	g = context->state[6];
+	h = context->state[7];
+	
+	for (i = 0; i < 64; i++) {
+		u32 t1 = h + (ROTATE_RIGHT_32(e, 6) ^ ROTATE_RIGHT_32(e, 11) ^ ROTATE_RIGHT_32(e, 25)) +
+				 ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		u32 t2 = (ROTATE_RIGHT_32(a, 2) ^ ROTATE_RIGHT_32(a, 13) ^ ROTATE_RIGHT_32(a, 22)) +
+				 ((a & b) ^ (a & c) ^ (b & c));
+		
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	
+	context->state[0] += a;
+	context->state[1] += b;
+	context->state[2] += c;
+	context->state[3] += d;
+	context->state[4] += e;
+	context->state[5] += f;
+	context->state[6] += g;
+	context->state[7] += h;
+}
+
+/**
+ * SHA256_init
+ * It initializes a SHA-256 context.
+ */
+void SHA256_init(CR2_SHA256_Context * context) {
+	static const u32 initial_state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	
+	memcpy(context->state, initial_state, sizeof(initial_state));
+	context->block_length = 0;
+	context->length = 0;
+}
+
+/**
+ * SHA256_update
+ * It adds data to the SHA-256 computation. Whole blocks are processed
+ * directly from the data, without copying them.
+ */
+void SHA256_update(CR2_SHA256_Context * context, const u8 * data, u64 length) {
+	context->length += length;
+	
+	if (context->block_length > 0) {
+		u32 missing = 64 - context->block_length;
+		u32 copied = (length < missing) ? (u32)length : missing;
+		
+		memcpy(context->block + context->block_length, data, copied);
+		context->block_length += copied;
+		data += copied;
+		length -= copied;
+		if (context->block_length < 64) {
+			return;
+		}
+		SHA256_transform(context, context->block);
+		context->block_length = 0;
+	}
+	
+	while (length >= 64) {
+		SHA256_transform(context, data);
+		data += 64;
+		length -= 64;
+	}
+	
+	memcpy(context->block, data, length);
+	context->block_length = length;
+}
+
+/**
+ * SHA256_final
+ * It adds the padding and stores the digest (32 bytes).
+ */
+void SHA256_final(CR2_SHA256_Context * context, u8 * digest) {
+	u64 bits = context->length * 8;
+	u32 i;
+	
+	context->block[context->block_length++] = 0x80;
+	if (context->block_length > 56) {
+		memset(context->block + context->block_length, 0x00, 64 - context->block_length);
+		SHA256_transform(context, context->block);
+		context->block_length = 0;
+	}
+	memset(context->block + context->block_length, 0x00, 56 - context->block_length);
+	for (i = 0; i < 8; i++) {
+		context->block[56+i] = (u8)(bits >> (56 - 8*i));
+	}
+	SHA256_transform(context, context->block);
+	
+	for (i = 0; i < 8; i++) {
+		digest[4*i]   = (u8)(context->state[i] >> 24);
+		digest[4*i+1] = (u8)(context->state[i] >> 16);
+		digest[4*i+2] = (u8)(context->state[i] >> 8);
+		digest[4*i+3] = (u8)(context->state[i]);
+	}
+}
+
+/**
+ * CR2_locate_raw_strip
+ * Params:
+ *   1. the name of the .cr2 file
+ *   2. the buffer where the strip offset and length are stored
+ * Return:
+ *   False if the IFD#3 raw strip cannot be found.
+ */
+boolean CR2_locate_raw_strip(const char * file_name, CR2_Raw_Hash * hash) {
+	CR2_Header header;
+	CR2_IFD ifd;
+	FILE *file;
+	u32 ifd_offset;
+	u32 i;
+	boolean found = false;
+	
+	hash->file_name = file_name;
+	hash->valid = false;
+	
+	file = fopen(file_name, "rb");
+	if (file == NULL) {
+		perror("[ERROR-fopen]");
+		return false;
+	}
+	
+	if (CR2_get_header(file, &header)) {
+		ifd_offset = ftell(file);
+		for (i = 0; i <= RAW_IFD_ID; i++) {
+			if (CR2_get_IFD(file, &ifd, ifd_offset) == 0) {
+				break;
+			}
+			if (i == RAW_IFD_ID) {
+				found = CR2_get_strip(&ifd, &hash->strip_offset, &hash->strip_length);
+			}
+			ifd_offset = ifd.next_IFD_offset;
+			free(ifd.dir_entries);
+		}
+	}
+	
+	fclose(file);
+	return found;
+}
+
+/**
+ * hash_strip_data
+ * It adds a part of the strip data to the hashes.
+ */
+static void hash_strip_data(CR2_Raw_Hash * hash, CR2_XXH64_Context * xxh64, CR2_SHA256_Context * sha256, const u8 * data, u64 length) {
+	XXH64_update(xxh64, data, length);
+	if (hash->use_SHA256) {
+		SHA256_update(sha256, data, length);
+	}
+}
+
+/**
+ * CR2_hash_raw_strip
+ * Params:
+ *   1. the hash, with the strip already located by CR2_locate_raw_strip
+ * Return:
+ *   False if the strip cannot be read.
+ *
+ * The strip is hashed directly from a read-only mapping of the file,
+ * without copying it. If the file cannot be mapped, it is read with
+ * pread in chunks, each one hashed as soon as it is read.
+ */
+boolean CR2_hash_raw_strip(CR2_Raw_Hash * hash) {
+	struct stat file_stat;
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t map_offset;
+	size_t map_length;
+	CR2_XXH64_Context xxh64;
+	CR2_SHA256_Context sha256;
+	u8 *map;
+	int fd;
+	
+	hash->valid = false;
+	fd = open(hash->file_name, O_RDONLY);
+	if (fd < 0) {
+		perror("[ERROR-open]");
+		return false;
+	}
+	if (fstat(fd, &file_stat) != 0 || (u64)hash->strip_offset + hash->strip_length > (u64)file_stat.st_size) {
+		fprintf(stderr, "[ERROR-CR2_hash_raw_strip] The raw strip of %s is out of the file\n", hash->file_name);
+		close(fd);
+		return false;
+	}
+	
+	XXH64_init(&xxh64, 0);
+	SHA256_init(&sha256);
+	
+	map_offset = hash->strip_offset - (hash->strip_offset % page_size);
+	map_length = hash->strip_length + (hash->strip_offset - map_offset);
+	map = (u8*)mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, map_offset);
+	if (map != MAP_FAILED) {
+		madvise(map, map_length, MADV_SEQUENTIAL);
+		hash_strip_data(hash, &xxh64, &sha256, map + (hash->strip_offset - map_offset), hash->strip_length);
+		munmap(map, map_length);
+		hash->valid = true;
+	}
+	else {
+		u8 *chunk = (u8*)malloc(HASH_CHUNK_SIZE);
+		u32 position = 0;
+		
+		while (chunk != NULL && position < hash->strip_length) {
+			size_t chunk_length = hash->strip_length - position;
+			ssize_t bytes_read;
+			
+			if (chunk_length > HASH_CHUNK_SIZE) {
+				chunk_length = HASH_CHUNK_SIZE;
+			}
+			bytes_read = pread(fd, chunk, chunk_length, (off_t)hash->strip_offset + position);
+			if (bytes_read <= 0) {
+				perror("[ERROR-pread]");
+				break;
+			}
+			hash_strip_data(hash, &xxh64, &sha256, chunk, bytes_read);
+			position += bytes_read;
+		}
+		hash->valid = (chunk != NULL && position == hash->strip_length);
+		free(chunk);
+	}
+	
+	if (hash->valid) {
+		hash->XXH64 = XXH64_final(&xxh64);
+		if (hash->use_SHA256) {
+			SHA256_final(&sha256, hash->SHA256);
+		}
+	}
+	
+	close(fd);
+	return hash->valid;
+}
+
+/**
+ * hash_band
+ * It hashes the files [first_file, last_file).
+ */
+static void hash_band(void * argument, u32 first_file, u32 last_file, u32 band_id) {
+	CR2_Raw_Hash *hashes = (CR2_Raw_Hash*)argument;
+	u32 i;
+	
+	(void)band_id;
+	for (i = first_file; i < last_file; i++) {
+		if (hashes[i].strip_length > 0) {
+			CR2_hash_raw_strip(&hashes[i]);
+		}
+	}
+}
+
+/**
+ * CR2_hash_files
+ * Params:
+ *   1. the hashes of the files, with the raw strips already located
+ *   2. the number of files
+ *
+ * The files are split between the threads.
+ */
+void CR2_hash_files(CR2_Raw_Hash * hashes, u32 count) {
+	CR2_run_bands(hash_band, hashes, count);
+}
+
+/**
+ * CR2_print_raw_hash
+ * Params:
+ *   1. the stream where you want to print the hash
+ *   2. the hash to print
+ * Return:
+ *   False if something goes wrong, true instead.
+ *
+ * The format used is:
+ *   [Raw_Hash]
+ *     File:         %s
+ *     Strip offset: 0x%X
+ *     Strip length: %d
+ *     XXH64:        %016llx
+ *     SHA-256:      %064x (only with --sha256)
+ *   [/Raw_Hash]
+ */
+boolean CR2_print_raw_hash(FILE * stream, CR2_Raw_Hash * hash) {
+	if (stream != NULL && hash != NULL) {
+		u32 i;
+		
+		fprintf(stream, "[Raw_Hash]\n");
+		fprintf(stream, "\tFile:          %s\n", hash->file_name);
+		fprintf(stream, "\tStrip offset:  0x%X\n", hash->strip_offset);
+		fprintf(stream, "\tStrip length:  %d\n", hash->strip_length);
+		if (hash->valid) {
+			fprintf(stream, "\tXXH64:         %016llx\n", hash->XXH64);
+			if (hash->use_SHA256) {
+				fprintf(stream, "\tSHA-256:       ");
+				for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+					fprintf(stream, "%02x", hash->SHA256[i]);
+				}
+				fprintf(stream, "\n");
+			}
+		}
+		else {
+			fprintf(stream, "\tXXH64:         (not available)\n");
+		}
+		fprintf(stream, "[/Raw_Hash]\n");
+		
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * CR2_sync
+ * It flushes the stream and waits until the data is on the disk.
+ * It returns false if something goes wrong.
+ */
+boolean CR2_sync(FILE * stream) {
+	if (stream == NULL || fflush(stream) != 0 || fsync(fileno(stream)) != 0) {
+		perror("[ERROR-CR2_sync]");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_set_ascii_tag
+ * Params:
+ *   1. the stream of the .cr2 file, opened for reading and writing
+ *   2. the ifd section that contains the tag
+ *   3. the tag ID to edit
+ *   4. the new value
+ * Return:
+ *   False if the tag is missing, isn't an ASCII tag or cannot be written.
+ *
+ * The file is never rewritten:
+ *   - if the new value fits in the old slot, it is written there and
+ *     padded with 0x00, so the directory entry doesn't change;
+ *   - values of 4 bytes or less are stored in the entry itself;
+ *   - otherwise the value is appended at the end of the file and only
+ *     the number of values and the offset of the entry are patched.
+ * The appended value is synced to the disk before the entry points to it,
+ * so an interrupted edit leaves the old value in place. When the entry
+ * doesn't point to the old slot anymore, and that is on the disk, the
+ * old slot is zeroed, so the old value doesn't stay in the file.
+ */
+boolean CR2_set_ascii_tag(FILE * stream, CR2_IFD * ifd, u16 tag_ID, const char * value) {
+	CR2_IFD_Directory_Entry * entry;
+	u32 old_offset = 0, old_length = 0;
+	u32 entry_offset;
+	u32 length;
+	
+	if (stream == NULL || ifd == NULL || value == NULL) {
+		return false;
+	}
+	
+	entry = CR2_find_entry(ifd, tag_ID);
+	if (entry == NULL || entry->tag_type != TIFF_TYPE_ASCII) {
+		fprintf(stderr, "[ERROR-CR2_set_ascii_tag] ASCII tag 0x%X not found\n", tag_ID);
+		return false;
+	}
+	entry_offset = ifd->offset + 2 + (entry - ifd->dir_entries)*IFD_ENTRY_SIZE;
+	length = strlen(value) + 1;
+	
+	if (entry->number_of_value > IFD_ENTRY_VALUE_SIZE && length <= entry->number_of_value) {
+		/* the value fits in the old slot */
+		char *padded_value = (char*)calloc(entry->number_of_value, sizeof(char));
+		
+		memcpy(padded_value, value, length);
+		if (fseek(stream, entry->value, SEEK_SET) != 0 ||
+			fwrite(padded_value, 1, entry->number_of_value, stream) != entry->number_of_value) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			free(padded_value);
+			return false;
+		}
+		free(padded_value);
+		
+		return CR2_sync(stream);
+	}
+	
+	/* the entry is moved away from the old slot */
+	if (entry->number_of_value > IFD_ENTRY_VALUE_SIZE) {
+		old_offset = entry->value;
+		old_length = entry->number_of_value;
+	}
+	
+	if (length <= IFD_ENTRY_VALUE_SIZE) {
+		/* the value is stored in the entry itself */
+		char inline_value[IFD_ENTRY_VALUE_SIZE] = {0};
+		
+		memcpy(inline_value, value, length);
+		if (fseek(stream, entry_offset + 4, SEEK_SET) != 0 || !put_uint(stream, length) ||
+			fwrite(inline_value, 1, IFD_ENTRY_VALUE_SIZE, stream) != IFD_ENTRY_VALUE_SIZE) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			return false;
+		}
+		memcpy(&entry->value, inline_value, IFD_ENTRY_VALUE_SIZE);
+		if (IS_BIG_ENDIAN) {
+			entry->value = DWORD_TO_LITTLE_ENDIAN(entry->value);
+		}
+		entry->number_of_value = length;
+	}
+	else {
+		/* the value is appended at the end of the file, on a word boundary */
+		long end_of_file;
+		
+		if (fseek(stream, 0, SEEK_END) != 0 || (end_of_file = ftell(stream)) < 0) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			return false;
+		}
+		if ((end_of_file & 1) && fputc(0x00, stream) == EOF) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			return false;
+		}
+		end_of_file += end_of_file & 1;
+		if (fwrite(value, 1, length, stream) != length || !CR2_sync(stream)) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			return false;
+		}
+		
+		if (fseek(stream, entry_offset + 4, SEEK_SET) != 0 ||
+			!put_uint(stream, length) || !put_uint(stream, end_of_file)) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			return false;
+		}
+		entry->number_of_value = length;
+		entry->value = end_of_file;
+	}
+	
+	if (!CR2_sync(stream)) {
+		return false;
+	}
+	
+	if (old_length > 0) {
+		char *zeros = (char*)calloc(old_length, sizeof(char));
+		
+		if (fseek(stream, old_offset, SEEK_SET) != 0 ||
+			fwrite(zeros, 1, old_length, stream) != old_length) {
+			perror("[ERROR-CR2_set_ascii_tag]");
+			free(zeros);
+			return false;
+		}
+		free(zeros);
+		
+		return CR2_sync(stream);
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_valid_date_time
+ * It returns true if the date is in the EXIF format "YYYY:MM:DD HH:MM:SS".
+ */
+boolean CR2_valid_date_time(const char * date_time) {
+	static const char *format = "dddd:dd:dd dd:dd:dd";
+	u32 i;
+	
+	if (date_time == NULL || strlen(date_time) != strlen(format)) {
+		return false;
+	}
+	
+	for (i = 0; format[i] != 0x00; i++) {
+		if ((format[i] == 'd') ? (date_time[i] < '0' || date_time[i] > '9') : (date_time[i] != format[i])) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_TIFF_TYPES
+ * The TIFF types, indexed by tag type.
+ */
+static const CR2_TIFF_Type CR2_TIFF_TYPES[TIFF_TYPE_LAST + 1] = {
+	{"UNKNOWN",   0, 0},
+	{"BYTE",      1, 1},
+	{"ASCII",     1, 1},
+	{"SHORT",     2, 2},
+	{"LONG",      4, 4},
+	{"RATIONAL",  8, 4},
+	{"SBYTE",     1, 1},
+	{"UNDEFINED", 1, 1},
+	{"SSHORT",    2, 2},
+	{"SLONG",     4, 4},
+	{"SRATIONAL", 8, 4},
+	{"FLOAT",     4, 4},
+	{"DOUBLE",    8, 8}
+};
+
+/**
+ * CR2_type_size
+ * Return:
+ *   The size in bytes of a single value of the TIFF type,
+ *   0 if the type is unknown.
+ */
+u32 CR2_type_size(u16 tag_type) {
+	return (tag_type <= TIFF_TYPE_LAST) ? CR2_TIFF_TYPES[tag_type].size : 0;
+}
+
+/**
+ * CR2_blank_tag
+ * Params:
+ *   1. the stream of the .cr2 file, opened for reading and writing
+ *   2. the ifd section that contains the tag
+ *   3. the tag ID to blank
+ * Return:
+ *   False if the value cannot be written. A missing tag is not an error.
+ *
+ * It overwrites the value of the tag with zeros, in the entry itself
+ * or at its offset, so the entry and the layout of the file don't change.
+ */
+boolean CR2_blank_tag(FILE * stream, CR2_IFD * ifd, u16 tag_ID) {
+	CR2_IFD_Directory_Entry * entry;
+	u32 entry_offset;
+	u64 size;
+	
+	entry = CR2_find_entry(ifd, tag_ID);
+	if (entry == NULL) {
+		return true;
+	}
+	entry_offset = ifd->offset + 2 + (entry - ifd->dir_entries)*IFD_ENTRY_SIZE;
+	size = (u64)entry->number_of_value * CR2_type_size(entry->tag_type);
+	
+	if (size <= IFD_ENTRY_VALUE_SIZE) {
+		if (fseek(stream, entry_offset + 8, SEEK_SET) != 0 || !put_uint(stream, 0)) {
+			perror("[ERROR-CR2_blank_tag]");
+			return false;
+		}
+		entry->value = 0;
+	}
+	else {
+		if (fseek(stream, entry->value, SEEK_SET) != 0) {
+			perror("[ERROR-CR2_blank_tag]");
+			return false;
+		}
+		while (size-- > 0) {
+			if (fputc(0x00, stream) == EOF) {
+				perror("[ERROR-CR2_blank_tag]");
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_remove_entry
+ * Params:
+ *   1. the stream of the .cr2 file, opened for reading and writing
+ *   2. the ifd section that contains the tag
+ *   3. the tag ID to remove
+ * Return:
+ *   False if the ifd cannot be written. A missing tag is not an error.
+ *
+ * The ifd is rewritten in place with one entry less: the following
+ * entries and the next IFD offset move back by 12 bytes, and the
+ * last 12 bytes of the old ifd are cleared. The entry's value isn't touched.
+ */
+boolean CR2_remove_entry(FILE * stream, CR2_IFD * ifd, u16 tag_ID) {
+	CR2_IFD_Directory_Entry * entry;
+	u8 empty_entry[IFD_ENTRY_SIZE] = {0};
+	boolean no_errors;
+	u32 i;
+	
+	entry = CR2_find_entry(ifd, tag_ID);
+	if (entry == NULL) {
+		return true;
+	}
+	
+	memmove(entry, entry + 1, (ifd->dir_entries + ifd->dir_entries_length - entry - 1)*sizeof(CR2_IFD_Directory_Entry));
+	ifd->dir_entries_length--;
+	
+	no_errors = (fseek(stream, ifd->offset, SEEK_SET) == 0) && put_ushort(stream, ifd->dir_entries_length);
+	for (i = 0; no_errors && i < ifd->dir_entries_length; i++) {
+		no_errors = put_ushort(stream, ifd->dir_entries[i].tag_ID) &&
+					put_ushort(stream, ifd->dir_entries[i].tag_type) &&
+					put_uint(stream, ifd->dir_entries[i].number_of_value) &&
+					put_uint(stream, ifd->dir_entries[i].value);
+	}
+	no_errors = no_errors && put_uint(stream, ifd->next_IFD_offset) &&
+				fwrite(empty_entry, 1, IFD_ENTRY_SIZE, stream) == IFD_ENTRY_SIZE;
+	
+	if (!no_errors) {
+		perror("[ERROR-CR2_remove_entry]");
+	}
+	return no_errors;
+}
+
+/**
+ * CR2_copy_file
+ * Params:
+ *   1. the file to copy
+ *   2. the destination file
+ *   3. the number of bytes to copy
+ * Return:
+ *   False if something goes wrong.
+ *
+ * The data is copied by the kernel with copy_file_range, without passing
+ * through user space (or by the file system itself, with reflinks).
+ * If the file systems don't support it, it falls back to read/write.
+ */
+boolean CR2_copy_file(int source_fd, int destination_fd, u64 length) {
+	loff_t source_offset = 0, destination_offset = 0;
+	u8 *buffer;
+	
+	while (length > 0) {
+		ssize_t copied = copy_file_range(source_fd, &source_offset, destination_fd, &destination_offset, length, 0);
+		
+		if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+			break;
+		}
+		if (copied <= 0) {
+			perror("[ERROR-copy_file_range]");
+			return false;
+		}
+		length -= copied;
+	}
+	
+	/* fallback */
+	buffer = (length > 0) ? (u8*)malloc(COPY_BUFFER_SIZE) : NULL;
+	while (length > 0) {
+		ssize_t bytes_read = pread(source_fd, buffer, (length < COPY_BUFFER_SIZE) ? length : COPY_BUFFER_SIZE, source_offset);
+		
+		if (bytes_read <= 0 || pwrite(destination_fd, buffer, bytes_read, destination_offset) != bytes_read) {
+			perror("[ERROR-CR2_copy_file]");
+			free(buffer);
+			return false;
+		}
+		source_offset += bytes_read;
+		destination_offset += bytes_read;
+		length -= bytes_read;
+	}
+	free(buffer);
+	
+	return true;
+}
+
+/**
+ * sanitize_tag
+ * It blanks the tag, after keeping a copy of its value in sensitive
+ * when it is an ASCII value long enough to be searched in the file.
+ */
+static boolean sanitize_tag(FILE * stream, CR2_IFD * ifd, u16 tag_ID, CR2_Sensitive_Values * sensitive) {
+	CR2_IFD_Directory_Entry *entry = CR2_find_entry(ifd, tag_ID);
+	
+	if (entry != NULL && entry->tag_type == TIFF_TYPE_ASCII && sensitive->count < MAX_SENSITIVE_VALUES) {
+		char *value = (char*)CR2_get_entry_values(stream, entry);
+		
+		if (value != NULL && strlen(value) >= SENSITIVE_VALUE_MIN_LENGTH) {
+			sensitive->values[sensitive->count++] = value;
+		}
+		else {
+			free(value);
+		}
+	}
+	
+	return CR2_blank_tag(stream, ifd, tag_ID);
+}
+
+/**
+ * CR2_sanitize
+ * Params:
+ *   1. the name of the .cr2 file
+ *   2. the name of the sanitized copy, that must not exist
+ * Return:
+ *   False if something goes wrong.
+ *
+ * The copy has the same layout of the original file, so the previews,
+ * the raw data and all the offsets stay valid and the bulk of the file
+ * is copied by the kernel. Only the metadata of the copy is then patched:
+ *   - owner names and serial numbers (EXIF and MakerNote) are blanked;
+ *   - the GPS IFD is cleared and its entry is removed from IFD#0;
+ *   - the other copies of the blanked owner names and serial numbers
+ *     (i.e. old values left by editors) are blanked (see CR2_blank_copies).
+ * The copy is written to a temporary file next to the destination and
+ * renamed only when it is complete. The destination is reserved with
+ * O_EXCL, so an existing file (or the source itself) is never overwritten.
+ */
+boolean CR2_sanitize(const char * source, const char * destination) {
+	CR2_IFD_Directory_Entry * entry;
+	CR2_Header header;
+	CR2_IFD ifd, exif, makernote, gps;
+	struct stat source_stat, destination_stat;
+	int source_fd, destination_fd, reserved_fd;
+	CR2_Sensitive_Values sensitive = {{NULL}, 0};
+	boolean no_errors, ifd_read;
+	char *temporary;
+	FILE *file;
+	u32 i;
+	
+	source_fd = open(source, O_RDONLY);
+	if (source_fd < 0 || fstat(source_fd, &source_stat) != 0) {
+		perror("[ERROR-open]");
+		if (source_fd >= 0) {
+			close(source_fd);
+		}
+		return false;
+	}
+	if (stat(destination, &destination_stat) == 0) {
+		if (destination_stat.st_dev == source_stat.st_dev && destination_stat.st_ino == source_stat.st_ino) {
+			fprintf(stderr, "[ERROR-CR2_sanitize] %s is the source file\n", destination);
+		}
+		else {
+			fprintf(stderr, "[ERROR-CR2_sanitize] %s already exists\n", destination);
+		}
+		close(source_fd);
+		return false;
+	}
+	
+	reserved_fd = open(destination, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (reserved_fd < 0) {
+		fprintf(stderr, "[ERROR-CR2_sanitize] Cannot create %s: %s\n", destination, strerror(errno));
+		close(source_fd);
+		return false;
+	}
+	close(reserved_fd);
+	
+	temporary = (char*)malloc(strlen(destination) + 8);
+	sprintf(temporary, "%s.XXXXXX", destination);
+	destination_fd = mkstemp(temporary);
+	if (destination_fd < 0) {
+		perror("[ERROR-mkstemp]");
+		close(source_fd);
+		unlink(destination);
+		free(temporary);
+		return false;
+	}
+	fchmod(destination_fd, 0644);
+	
+	no_errors = CR2_copy_file(source_fd, destination_fd, source_stat.st_size);
+	close(source_fd);
+	if (!no_errors || (file = fdopen(destination_fd, "r+b")) == NULL) {
+		close(destination_fd);
+		unlink(temporary);
+		unlink(destination);
+		free(temporary);
+		return false;
+	}
+	
+	ifd_read = CR2_get_header(file, &header) && CR2_get_IFD(file, &ifd, ftell(file)) != 0;
+	no_errors = ifd_read;
+	
+	/* EXIF and MakerNote */
+	entry = no_errors ? CR2_find_entry(&ifd, CR2_TAG_EXIF) : NULL;
+	if (no_errors && entry != NULL && CR2_get_IFD(file, &exif, entry->value) != 0) {
+		no_errors = sanitize_tag(file, &exif, CR2_TAG_CAMERA_OWNER_NAME, &sensitive) &&
+					sanitize_tag(file, &exif, CR2_TAG_BODY_SERIAL_NUMBER, &sensitive) &&
+					sanitize_tag(file, &exif, CR2_TAG_LENS_SERIAL_NUMBER, &sensitive);
+		
+		entry = CR2_find_entry(&exif, CR2_TAG_MAKERNOTE);
+		if (no_errors && entry != NULL && CR2_get_IFD(file, &makernote, entry->value) != 0) {
+			no_errors = sanitize_tag(file, &makernote, CR2_TAG_OWNER_NAME, &sensitive) &&
+						sanitize_tag(file, &makernote, CR2_TAG_SERIAL_NUMBER, &sensitive) &&
+						sanitize_tag(file, &makernote, CR2_TAG_INTERNAL_SERIAL_NUMBER, &sensitive);
+			free(makernote.dir_entries);
+		}
+		free(exif.dir_entries);
+	}
+	
+	/* GPS */
+	entry = no_errors ? CR2_find_entry(&ifd, CR2_TAG_GPS) : NULL;
+	if (no_errors && entry != NULL) {
+		if (CR2_get_IFD(file, &gps, entry->value) != 0) {
+			u32 size = 2 + gps.dir_entries_length*IFD_ENTRY_SIZE + 4;
+			
+			for (i = 0; no_errors && i < gps.dir_entries_length; i++) {
+				no_errors = CR2_blank_tag(file, &gps, gps.dir_entries[i].tag_ID);
+			}
+			no_errors = no_errors && fseek(file, gps.offset, SEEK_SET) == 0;
+			for (i = 0; no_errors && i < size; i++) {
+				no_errors = (fputc(0x00, file) != EOF);
+			}
+			free(gps.dir_entries);
+		}
+		no_errors = no_errors && CR2_remove_entry(file, &ifd, CR2_TAG_GPS);
+	}
+	
+	if (ifd_read) {
+		free(ifd.dir_entries);
+	}
+	no_errors = no_errors && CR2_blank_copies(file, &sensitive) && CR2_sync(file);
+	for (i = 0; i < sensitive.count; i++) {
+		free(sensitive.values[i]);
+	}
+	if (fclose(file) != 0 || !no_errors || rename(temporary, destination) != 0) {
+		fprintf(stderr, "[ERROR-CR2_sanitize] Cannot write %s\n", destination);
+		unlink(temporary);
+		unlink(destination);
+		free(temporary);
+		return false;
+	}
+	
+	free(temporary);
+	return true;
+}
+
+/**
+ * CR2_blank_copies
+ * Params:
+ *   1. the stream of the .cr2 file, opened for reading and writing
+ *   2. the values already blanked in their tags
+ * Return:
+ *   False if the file cannot be mapped or written.
+ *
+ * Editors that move a value (i.e. a longer owner name appended at the end
+ * of the file) may leave the old value where it was. Every other copy of
+ * the blanked values, terminated by 0x00, is cleared. The image strips
+ * of the four IFDs are never touched.
+ */
+boolean CR2_blank_copies(FILE * stream, CR2_Sensitive_Values * sensitive) {
+	CR2_Range strips[2*NUMBER_OF_IFD];
+	CR2_IFD_Directory_Entry *jpeg_offset, *jpeg_length;
+	CR2_Header header;
+	struct stat file_stat;
+	u32 number_of_strips = 0;
+	u32 ifd_offset, i, k;
+	u8 *map;
+	
+	if (stream == NULL || sensitive == NULL) {
+		return false;
+	}
+	if (sensitive->count == 0) {
+		return true;
+	}
+	if (fflush(stream) != 0 || fstat(fileno(stream), &file_stat) != 0 || !CR2_get_header(stream, &header)) {
+		perror("[ERROR-CR2_blank_copies]");
+		return false;
+	}
+	
+	ifd_offset = ftell(stream);
+	for (i = 0; i < NUMBER_OF_IFD && ifd_offset != 0; i++) {
+		CR2_IFD ifd;
+		u32 strip_offset, strip_length;
+		
+		if (CR2_get_IFD(stream, &ifd, ifd_offset) == 0) {
+			break;
+		}
+		/* the strip and the jpeg of each IFD */
+		if (CR2_get_strip(&ifd, &strip_offset, &strip_length)) {
+			strips[number_of_strips].offset = strip_offset;
+			strips[number_of_strips++].length = strip_length;
+		}
+		jpeg_offset = CR2_find_entry(&ifd, CR2_TAG_JPEG_OFFSET);
+		jpeg_length = CR2_find_entry(&ifd, CR2_TAG_JPEG_LENGTH);
+		if (jpeg_offset != NULL && jpeg_length != NULL) {
+			strips[number_of_strips].offset = jpeg_offset->value;
+			strips[number_of_strips++].length = jpeg_length->value;
+		}
+		ifd_offset = ifd.next_IFD_offset;
+		free(ifd.dir_entries);
+	}
+	
+	map = (u8*)mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(stream), 0);
+	if (map == MAP_FAILED) {
+		perror("[ERROR-mmap]");
+		return false;
+	}
+	
+	for (i = 0; i < sensitive->count; i++) {
+		size_t length = strlen(sensitive->values[i]) + 1;
+		u8 *end = map + file_stat.st_size;
+		u8 *found = map;
+		
+		while ((found = (u8*)memmem(found, end - found, sensitive->values[i], length)) != NULL) {
+			u64 position = found - map;
+			boolean in_strip = false;
+			
+			for (k = 0; k < number_of_strips && !in_strip; k++) {
+				in_strip = (position + length > strips[k].offset && position < strips[k].offset + strips[k].length);
+			}
+			if (!in_strip) {
+				memset(found, 0x00, length);
+			}
+			found += length;
+		}
+	}
+	
+	if (msync(map, file_stat.st_size, MS_SYNC) != 0) {
+		perror("[ERROR-msync]");
+		munmap(map, file_stat.st_size);
+		return false;
+	}
+	munmap(map, file_stat.st_size);
+	
+	return true;
+}
+
+/**
+ * CR2_scan_lossless_jpeg
+ * Params:
+ *   1. the lossless jpeg stored in the IFD#3 strip
+ *   2. the length of the strip
+ *   3. the buffer where the position of the error is stored
+ * Return:
+ *   NULL if the jpeg is well formed, a description of the error instead.
+ *
+ * It checks the marker sequence from SOI to EOI without decoding the
+ * Huffman data: the segments before the scan are walked through their
+ * lengths, then the entropy coded data is searched for 0xFF with memchr
+ * (vectorized by the C library), so only the markers are looked at.
+ */
+const char* CR2_scan_lossless_jpeg(const u8 * data, u32 length, u32 * error_position) {
+	u32 position = 2;
+	
+	*error_position = 0;
+	if (length < 4 || data[0] != 0xFF || data[1] != JPEG_MARKER_SOI) {
+		return "SOI not found";
+	}
+	
+	/* segments up to the start of scan */
+	for (;;) {
+		u32 segment_length;
+		u8 marker;
+		
+		*error_position = position;
+		if (position + 4 > length) {
+			return "truncated before the start of scan";
+		}
+		if (data[position] != 0xFF) {
+			return "marker expected";
+		}
+		marker = data[position+1];
+		if (marker == 0xFF) {
+			position++;
+			continue;
+		}
+		if (marker == JPEG_MARKER_EOI) {
+			return "EOI before the start of scan";
+		}
+		if (marker == JPEG_MARKER_TEM || (marker >= JPEG_MARKER_RST0 && marker <= JPEG_MARKER_RST7)) {
+			position += 2;
+			continue;
+		}
+		segment_length = (data[position+2] << 8) | data[position+3];
+		if (segment_length < 2 || position + 2 + segment_length > length) {
+			return "truncated segment";
+		}
+		position += 2 + segment_length;
+		if (marker == JPEG_MARKER_SOS) {
+			break;
+		}
+	}
+	
+	/* entropy coded data: only 0xFF00, RSTn and EOI are allowed */
+	for (;;) {
+		const u8 *next = (const u8*)memchr(data + position, 0xFF, length - position);
+		
+		if (next == NULL || next + 1 >= data + length) {
+			*error_position = length;
+			return "EOI not found, the stream is truncated";
+		}
+		position = next - data;
+		*error_position = position;
+		switch (next[1]) {
+			case 0x00:
+				position += 2;
+			break;
+			
+			case 0xFF:
+				position++;
+			break;
+			
+			case JPEG_MARKER_EOI:
+				return NULL;
+			
+			default:
+				if (next[1] < JPEG_MARKER_RST0 || next[1] > JPEG_MARKER_RST7) {
+					return "unexpected marker in the entropy coded data";
+				}
+				position += 2;
+		}
+	}
+}
+
+/**
+ * verify_range
+ * It reports an error if [offset, offset + length) isn't inside the file.
+ */
+static boolean verify_range(FILE * report, const char * what, u64 offset, u64 length, u64 file_size, u32 * errors) {
+	if (offset + length > file_size) {
+		fprintf(report, "\tError:   %s out of the file (0x%llX + %llu > %llu)\n", what, offset, length, file_size);
+		(*errors)++;
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * verify_IFD
+ * It checks that the ifd and all the values pointed by its entries
+ * are inside the file, and reads it. It returns false if the ifd
+ * cannot be read; otherwise the ifd must be freed by the caller.
+ */
+static boolean verify_IFD(FILE * stream, FILE * report, const char * name, u32 offset, u64 file_size, CR2_IFD * ifd, u32 * errors) {
+	char what[64];
+	u16 length;
+	u32 i;
+	
+	if (offset == 0 || !verify_range(report, name, offset, 2, file_size, errors) || fseek(stream, offset, SEEK_SET) != 0) {
+		return false;
+	}
+	length = get_ushort(stream);
+	if (length == 0 || !verify_range(report, name, offset, 2 + length*IFD_ENTRY_SIZE + 4, file_size, errors) ||
+		CR2_get_IFD(stream, ifd, offset) == 0) {
+		return false;
+	}
+	
+	for (i = 0; i < ifd->dir_entries_length; i++) {
+		u64 size = (u64)ifd->dir_entries[i].number_of_value * CR2_type_size(ifd->dir_entries[i].tag_type);
+		
+		if (size > IFD_ENTRY_VALUE_SIZE) {
+			sprintf(what, "%s tag 0x%X", name, ifd->dir_entries[i].tag_ID);
+			verify_range(report, what, ifd->dir_entries[i].value, size, file_size, errors);
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_verify
+ * Params:
+ *   1. the name of the .cr2 file
+ *   2. the stream where the report is printed
+ * Return:
+ *   False if the file is truncated or corrupted.
+ *
+ * It checks the header, that every IFD (also EXIF, MakerNote and GPS),
+ * every value and every strip is inside the file, and that the IFD#3
+ * lossless jpeg is complete up to EOI. The report format is:
+ *   [Verify]
+ *     File:    %s
+ *     Error:   %s (one line for each error)
+ *     Status:  OK or CORRUPTED
+ *   [/Verify]
+ */
+boolean CR2_verify(const char * file_name, FILE * report) {
+	static const char *names[NUMBER_OF_IFD] = {"IFD#0", "IFD#1", "IFD#2", "IFD#3"};
+	CR2_IFD_Directory_Entry *entry, *length_entry;
+	CR2_Header header;
+	CR2_IFD ifd, exif, makernote, gps;
+	struct stat file_stat;
+	u32 ifd_offset, strip_offset = 0, strip_length = 0;
+	u32 errors = 0;
+	u32 i;
+	boolean valid_header = true;
+	boolean valid_strip;
+	FILE *file;
+	
+	fprintf(report, "[Verify]\n");
+	fprintf(report, "\tFile:    %s\n", file_name);
+	
+	file = fopen(file_name, "rb");
+	if (file == NULL || fstat(fileno(file), &file_stat) != 0) {
+		fprintf(report, "\tError:   cannot open the file\n");
+		fprintf(report, "\tStatus:  CORRUPTED\n");
+		fprintf(report, "[/Verify]\n");
+		if (file != NULL) {
+			fclose(file);
+		}
+		return false;
+	}
+	
+	/* header */
+	if (file_stat.st_size < 16 || !CR2_get_header(file, &header) ||
+		header.TIFF_magic_word != TIFF_MAGIC_WORD || header.CR2_magic_word != CR2_MAGIC_WORD) {
+		fprintf(report, "\tError:   invalid CR2 header\n");
+		errors++;
+		valid_header = false;
+	}
+	
+	ifd_offset = header.TIFF_offset;
+	for (i = 0; valid_header && i < NUMBER_OF_IFD; i++) {
+		if (!verify_IFD(file, report, names[i], ifd_offset, file_stat.st_size, &ifd, &errors)) {
+			fprintf(report, "\tError:   %s cannot be read\n", names[i]);
+			errors++;
+			break;
+		}
+		
+		/* strips and thumbnail */
+		valid_strip = CR2_get_strip(&ifd, &strip_offset, &strip_length) &&
+					  verify_range(report, "strip", strip_offset, strip_length, file_stat.st_size, &errors);
+		entry = CR2_find_entry(&ifd, CR2_TAG_JPEG_OFFSET);
+		length_entry = CR2_find_entry(&ifd, CR2_TAG_JPEG_LENGTH);
+		if (entry != NULL && length_entry != NULL) {
+			verify_range(report, "thumbnail", entry->value, length_entry->value, file_stat.st_size, &errors);
+		}
+		
+		/* sub IFDs of IFD#0 */
+		if (i == 0) {
+			entry = CR2_find_entry(&ifd, CR2_TAG_EXIF);
+			if (entry != NULL && verify_IFD(file, report, "EXIF", entry->value, file_stat.st_size, &exif, &errors)) {
+				entry = CR2_find_entry(&exif, CR2_TAG_MAKERNOTE);
+				if (entry != NULL &&
+					verify_IFD(file, report, "MakerNote", entry->value, file_stat.st_size, &makernote, &errors)) {
+					free(makernote.dir_entries);
+				}
+				free(exif.dir_entries);
+			}
+			entry = CR2_find_entry(&ifd, CR2_TAG_GPS);
+			if (entry != NULL && verify_IFD(file, report, "GPS", entry->value, file_stat.st_size, &gps, &errors)) {
+				free(gps.dir_entries);
+			}
+		}
+		
+		/* raw data */
+		if (i == RAW_IFD_ID && valid_strip) {
+			long page_size = sysconf(_SC_PAGESIZE);
+			off_t map_offset = strip_offset - (strip_offset % page_size);
+			size_t map_length = strip_length + (strip_offset - map_offset);
+			u8 *map = (u8*)mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fileno(file), map_offset);
+			
+			if (map != MAP_FAILED) {
+				const char *error;
+				u32 error_position;
+				
+				madvise(map, map_length, MADV_SEQUENTIAL);
+				error = CR2_scan_lossless_jpeg(map + (strip_offset - map_offset), strip_length, &error_position);
+				if (error != NULL) {
+					fprintf(report, "\tError:   raw jpeg: %s (at 0x%X)\n", error, strip_offset + error_position);
+					errors++;
+				}
+				munmap(map, map_length);
+			}
+			else {
+				perror("[ERROR-mmap]");
+				errors++;
+			}
+		}
+		
+		ifd_offset = ifd.next_IFD_offset;
+		free(ifd.dir_entries);
+	}
+	
+	fprintf(report, "\tStatus:  %s\n", (errors == 0) ? "OK" : "CORRUPTED");
+	fprintf(report, "[/Verify]\n");
+	
+	fclose(file);
+	return (errors == 0);
+}
+
+/**
+ * CR2_catalogue_init
+ * It initializes an empty catalogue.
+ */
+void CR2_catalogue_init(CR2_Catalogue * catalogue) {
+	memset(catalogue, 0x00, sizeof(CR2_Catalogue));
+}
+
+/**
+ * dictionary_encode
+ * It returns the index of the string in the dictionary,
+ * adding it if it isn't there yet.
+ */
+static u32 dictionary_encode(CR2_Dictionary * dictionary, const char * string) {
+	u32 slot, i;
+	
+	if (string == NULL) {
+		string = "";
+	}
+	
+	/* keep the hash table at most half full */
+	if (2*(dictionary->count + 1) > dictionary->number_of_slots) {
+		u32 number_of_slots = (dictionary->number_of_slots == 0) ? 64 : 2*dictionary->number_of_slots;
+		
+		free(dictionary->slots);
+		dictionary->slots = (u32*)calloc(number_of_slots, sizeof(u32));
+		dictionary->number_of_slots = number_of_slots;
+		for (i = 0; i < dictionary->count; i++) {
+			slot = XXH64((const u8*)dictionary->strings[i], strlen(dictionary->strings[i]), 0) & (number_of_slots - 1);
+			while (dictionary->slots[slot] != 0) {
+				slot = (slot + 1) & (number_of_slots - 1);
+			}
+			dictionary->slots[slot] = i + 1;
+		}
+	}
+	
+	slot = XXH64((const u8*)string, strlen(string), 0) & (dictionary->number_of_slots - 1);
+	while (dictionary->slots[slot] != 0) {
+		if (strcmp(dictionary->strings[dictionary->slots[slot] - 1], string) == 0) {
+			return dictionary->slots[slot] - 1;
+		}
+		slot = (slot + 1) & (dictionary->number_of_slots - 1);
+	}
+	
+	if (dictionary->count == dictionary->capacity) {
+		dictionary->capacity = (dictionary->capacity == 0) ? 16 : 2*dictionary->capacity;
+		dictionary->strings = (char**)realloc(dictionary->strings, dictionary->capacity*sizeof(char*));
+	}
+	dictionary->strings[dictionary->count] = strdup(string);
+	dictionary->slots[slot] = ++dictionary->count;
+	
+	return dictionary->count - 1;
+}
+
+/**
+ * date_to_number
+ * It converts "YYYY:MM:DD HH:MM:SS" into YYYYMMDDhhmmss, 0 if it isn't valid.
+ */
+static u64 date_to_number(const char * date_time) {
+	u64 number = 0;
+	u32 i;
+	
+	if (!CR2_valid_date_time(date_time)) {
+		return 0;
+	}
+	for (i = 0; date_time[i] != 0x00; i++) {
+		if (date_time[i] >= '0' && date_time[i] <= '9') {
+			number = number*10 + (date_time[i] - '0');
+		}
+	}
+	
+	return number;
+}
+
+/**
+ * CR2_catalogue_add
+ * Params:
+ *   1. the catalogue
+ *   2. the image info to add as a new row
+ */
+void CR2_catalogue_add(CR2_Catalogue * catalogue, CR2_Image_Info * info) {
+	u32 row = catalogue->rows;
+	u32 c;
+	
+	if (row == catalogue->capacity) {
+		u32 capacity = (catalogue->capacity == 0) ? 1024 : 2*catalogue->capacity;
+		
+		catalogue->image_width = (u16*)realloc(catalogue->image_width, capacity*sizeof(u16));
+		catalogue->image_height = (u16*)realloc(catalogue->image_height, capacity*sizeof(u16));
+		catalogue->focal_length = (u16*)realloc(catalogue->focal_length, capacity*sizeof(u16));
+		catalogue->compression = (u16*)realloc(catalogue->compression, capacity*sizeof(u16));
+		catalogue->exposure_time = (u32*)realloc(catalogue->exposure_time, 2*capacity*sizeof(u32));
+		catalogue->f_number = (u32*)realloc(catalogue->f_number, 2*capacity*sizeof(u32));
+		for (c = 0; c < CATALOGUE_DICTIONARIES; c++) {
+			catalogue->codes[c] = (u32*)realloc(catalogue->codes[c], capacity*sizeof(u32));
+		}
+		catalogue->date = (u64*)realloc(catalogue->date, capacity*sizeof(u64));
+		catalogue->capacity = capacity;
+	}
+	
+	catalogue->image_width[row] = info->image_width;
+	catalogue->image_height[row] = info->image_height;
+	catalogue->focal_length[row] = info->focal_length;
+	catalogue->compression[row] = info->compression;
+	catalogue->exposure_time[2*row] = info->exposure_time_rational[0];
+	catalogue->exposure_time[2*row+1] = info->exposure_time_rational[1];
+	catalogue->f_number[2*row] = info->f_number_rational[0];
+	catalogue->f_number[2*row+1] = info->f_number_rational[1];
+	catalogue->codes[0][row] = dictionary_encode(&catalogue->dictionaries[0], info->model);
+	catalogue->codes[1][row] = dictionary_encode(&catalogue->dictionaries[1], info->lens_model);
+	catalogue->codes[2][row] = dictionary_encode(&catalogue->dictionaries[2], info->owner_name);
+	catalogue->date[row] = date_to_number(info->date_time);
+	catalogue->rows++;
+}
+
+/**
+ * compare_dates
+ * qsort comparator of the row indexes, by date (the dates are in sort_dates).
+ */
+static const u64 *sort_dates;
+
+static int compare_dates(const void * a, const void * b) {
+	u64 first = sort_dates[*(const u32*)a];
+	u64 second = sort_dates[*(const u32*)b];
+	
+	if (first != second) {
+		return (first < second) ? -1 : 1;
+	}
+	return (*(const u32*)a < *(const u32*)b) ? -1 : 1;
+}
+
+/**
+ * write_column
+ * It writes the data of a column at the next aligned position and
+ * fills its descriptor.
+ */
+static boolean write_column(FILE * file, CR2_Catalogue_Column * column, const char * name, u32 type,
+							const void * data, u64 length) {
+	long position = ftell(file);
+	
+	while (position % CATALOGUE_ALIGNMENT != 0) {
+		if (fputc(0x00, file) == EOF) {
+			return false;
+		}
+		position++;
+	}
+	
+	memset(column, 0x00, sizeof(CR2_Catalogue_Column));
+	strncpy(column->name, name, CATALOGUE_COLUMN_NAME - 1);
+	column->type = type;
+	column->offset = position;
+	column->length = length;
+	
+	return length == 0 || fwrite(data, 1, length, file) == length;
+}
+
+/**
+ * write_dictionary
+ * It writes a dictionary as a CATALOGUE_TYPE_STRINGS column.
+ */
+static boolean write_dictionary(FILE * file, CR2_Catalogue_Column * column, const char * name, CR2_Dictionary * dictionary) {
+	u32 *offsets = (u32*)malloc((dictionary->count + 2)*sizeof(u32));
+	u64 length;
+	char *data, *characters;
+	boolean written;
+	u32 i;
+	
+	offsets[0] = dictionary->count;
+	offsets[1] = 0;
+	for (i = 0; i < dictionary->count; i++) {
+		offsets[i+2] = offsets[i+1] + strlen(dictionary->strings[i]);
+	}
+	
+	length = (dictionary->count + 2)*sizeof(u32) + offsets[dictionary->count + 1];
+	data = (char*)malloc(length);
+	memcpy(data, offsets, (dictionary->count + 2)*sizeof(u32));
+	characters = data + (dictionary->count + 2)*sizeof(u32);
+	for (i = 0; i < dictionary->count; i++) {
+		memcpy(characters + offsets[i+1], dictionary->strings[i], offsets[i+2] - offsets[i+1]);
+	}
+	
+	written = write_column(file, column, name, CATALOGUE_TYPE_STRINGS, data, length);
+	free(data);
+	free(offsets);
+	return written;
+}
+
+/**
+ * CR2_catalogue_write
+ * Params:
+ *   1. the catalogue
+ *   2. the path of the catalogue file
+ * Return:
+ *   False if something goes wrong.
+ *
+ * The columns are: image_width, image_height, focal_length, compression
+ * (u16), exposure_time, f_number (rationals), model, lens, owner
+ * (dictionary codes, with the "model.dict", "lens.dict" and "owner.dict"
+ * columns), date (YYYYMMDDhhmmss) and date.sorted, the row indexes
+ * sorted by date.
+ */
+boolean CR2_catalogue_write(CR2_Catalogue * catalogue, const char * path) {
+	static const char *dictionary_names[CATALOGUE_DICTIONARIES][2] = {
+		{"model", "model.dict"}, {"lens", "lens.dict"}, {"owner", "owner.dict"}
+	};
+	CR2_Catalogue_Header header;
+	CR2_Catalogue_Column columns[CATALOGUE_COLUMNS];
+	u32 rows = catalogue->rows;
+	u32 *date_order;
+	boolean no_errors;
+	u32 c, i;
+	FILE *file;
+	
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		perror("[ERROR-fopen]");
+		return false;
+	}
+	
+	memset(&header, 0x00, sizeof(header));
+	memcpy(header.magic, CATALOGUE_MAGIC, sizeof(header.magic));
+	header.version = CATALOGUE_VERSION;
+	header.number_of_rows = rows;
+	header.number_of_columns = CATALOGUE_COLUMNS;
+	
+	/* the directory is written at the end, when the offsets are known */
+	no_errors = fseek(file, sizeof(header) + sizeof(columns), SEEK_SET) == 0;
+	
+	date_order = (u32*)malloc((rows + 1)*sizeof(u32));
+	for (i = 0; i < rows; i++) {
+		date_order[i] = i;
+	}
+	sort_dates = catalogue->date;
+	qsort(date_order, rows, sizeof(u32), compare_dates);
+	
+	no_errors = no_errors &&
+		write_column(file, &columns[0], "image_width", CATALOGUE_TYPE_U16, catalogue->image_width, rows*sizeof(u16)) &&
+		write_column(file, &columns[1], "image_height", CATALOGUE_TYPE_U16, catalogue->image_height, rows*sizeof(u16)) &&
+		write_column(file, &columns[2], "focal_length", CATALOGUE_TYPE_U16, catalogue->focal_length, rows*sizeof(u16)) &&
+		write_column(file, &columns[3], "compression", CATALOGUE_TYPE_U16, catalogue->compression, rows*sizeof(u16)) &&
+		write_column(file, &columns[4], "exposure_time", CATALOGUE_TYPE_RATIONAL, catalogue->exposure_time, 2*rows*sizeof(u32)) &&
+		write_column(file, &columns[5], "f_number", CATALOGUE_TYPE_RATIONAL, catalogue->f_number, 2*rows*sizeof(u32));
+	for (c = 0; no_errors && c < CATALOGUE_DICTIONARIES; c++) {
+		no_errors = write_column(file, &columns[6+2*c], dictionary_names[c][0], CATALOGUE_TYPE_CODE,
+								 catalogue->codes[c], rows*sizeof(u32)) &&
+					write_dictionary(file, &columns[7+2*c], dictionary_names[c][1], &catalogue->dictionaries[c]);
+	}
+	no_errors = no_errors &&
+		write_column(file, &columns[12], "date", CATALOGUE_TYPE_U64, catalogue->date, rows*sizeof(u64)) &&
+		write_column(file, &columns[13], "date.sorted", CATALOGUE_TYPE_ROW_INDEX, date_order, rows*sizeof(u32));
+	free(date_order);
+	
+	no_errors = no_errors && fseek(file, 0, SEEK_SET) == 0 &&
+				fwrite(&header, sizeof(header), 1, file) == 1 &&
+				fwrite(columns, sizeof(columns), 1, file) == 1;
+	
+	if (fclose(file) != 0 || !no_errors) {
+		perror("[ERROR-CR2_catalogue_write]");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * CR2_catalogue_destroy
+ * It frees the memory allocated for the catalogue.
+ */
+void CR2_catalogue_destroy(CR2_Catalogue * catalogue) {
+	u32 c, i;
+	
+	free(catalogue->image_width);
+	free(catalogue->image_height);
+	free(catalogue->focal_length);
+	free(catalogue->compression);
+	free(catalogue->exposure_time);
+	free(catalogue->f_number);
+	free(catalogue->date);
+	for (c = 0; c < CATALOGUE_DICTIONARIES; c++) {
+		free(catalogue->codes[c]);
+		for (i = 0; i < catalogue->dictionaries[c].count; i++) {
+			free(catalogue->dictionaries[c].strings[i]);
+		}
+		free(catalogue->dictionaries[c].strings);
+		free(catalogue->dictionaries[c].slots);
+	}
+	CR2_catalogue_init(catalogue);
+}
+
+/**
+ * find_column
+ * It returns the descriptor of a column of a mapped catalogue, NULL if
+ * it's missing, misaligned, or it's out of the column data.
+ */
+static const CR2_Catalogue_Column * find_column(const u8 * map, u64 size, const char * name, u32 type) {
+	const CR2_Catalogue_Header *header = (const CR2_Catalogue_Header*)map;
+	const CR2_Catalogue_Column *columns = (const CR2_Catalogue_Column*)(map + sizeof(CR2_Catalogue_Header));
+	u64 data_start = sizeof(CR2_Catalogue_Header) + (u64)header->number_of_columns*sizeof(CR2_Catalogue_Column);
+	u32 i;
+	
+	if (data_start > size) {
+		return NULL;
+	}
+	for (i = 0; i < header->number_of_columns; i++) {
+		if (strncmp(columns[i].name, name, CATALOGUE_COLUMN_NAME) == 0 && columns[i].type == type &&
+			columns[i].offset >= data_start && columns[i].offset % CATALOGUE_ALIGNMENT == 0 &&
+			columns[i].offset <= size && columns[i].length <= size - columns[i].offset) {
+			return &columns[i];
+		}
+	}
+	
+	return NULL;
+}
+
+/**
+ * CR2_catalogue_lens_usage
+ * Params:
+ *   1. the path of the catalogue file
+ *   2. the stream where the histogram is printed
+ * Return:
+ *   False if the catalogue cannot be read.
+ *
+ * The catalogue is mapped and the lens codes are counted directly,
+ * without parsing anything. The format used is:
+ *   [Lens_Usage]
+ *     %d: %s (one line for each lens)
+ *   [/Lens_Usage]
+ */
+boolean CR2_catalogue_lens_usage(const char * path, FILE * stream) {
+	const CR2_Catalogue_Column *codes_column, *dictionary_column;
+	const CR2_Catalogue_Header *header;
+	const u32 *codes, *dictionary;
+	struct stat file_stat;
+	u64 characters;
+	u32 *counts;
+	u32 rows, lenses, i;
+	u8 *map;
+	int fd;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &file_stat) != 0 || (u64)file_stat.st_size < sizeof(CR2_Catalogue_Header)) {
+		perror("[ERROR-CR2_catalogue_lens_usage]");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	map = (u8*)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("[ERROR-mmap]");
+		return false;
+	}
+	
+	header = (const CR2_Catalogue_Header*)map;
+	codes_column = find_column(map, file_stat.st_size, "lens", CATALOGUE_TYPE_CODE);
+	dictionary_column = find_column(map, file_stat.st_size, "lens.dict", CATALOGUE_TYPE_STRINGS);
+	if (memcmp(header->magic, CATALOGUE_MAGIC, sizeof(header->magic)) != 0 || codes_column == NULL ||
+		dictionary_column == NULL || codes_column->length != (u64)header->number_of_rows*sizeof(u32) ||
+		dictionary_column->length < sizeof(u32)) {
+		fprintf(stderr, "[ERROR-CR2_catalogue_lens_usage] %s isn't a valid catalogue\n", path);
+		munmap(map, file_stat.st_size);
+		return false;
+	}
+	
+	rows = header->number_of_rows;
+	codes = (const u32*)(map + codes_column->offset);
+	dictionary = (const u32*)(map + dictionary_column->offset);
+	lenses = dictionary[0];
+	if (((u64)lenses + 2)*sizeof(u32) > dictionary_column->length) {
+		fprintf(stderr, "[ERROR-CR2_catalogue_lens_usage] %s isn't a valid catalogue\n", path);
+		munmap(map, file_stat.st_size);
+		return false;
+	}
+	
+	/* the string offsets never decrease and stay in the column */
+	characters = dictionary_column->length - ((u64)lenses + 2)*sizeof(u32);
+	for (i = 0; i <= lenses; i++) {
+		if (dictionary[i+1] > characters || (i > 0 && dictionary[i+1] < dictionary[i])) {
+			fprintf(stderr, "[ERROR-CR2_catalogue_lens_usage] %s isn't a valid catalogue\n", path);
+			munmap(map, file_stat.st_size);
+			return false;
+		}
+	}
+	
+	counts = (u32*)calloc(lenses + 1, sizeof(u32));
+	for (i = 0; i < rows; i++) {
+		counts[(codes[i] < lenses) ? codes[i] : lenses]++;
+	}
+	
+	fprintf(stream, "[Lens_Usage]\n");
+	for (i = 0; i < lenses; i++) {
+		const char *name = (const char*)(dictionary + lenses + 2) + dictionary[i+1];
+		
+		fprintf(stream, "\t%d: %.*s\n", counts[i], (int)(dictionary[i+2] - dictionary[i+1]), name);
+	}
+	fprintf(stream, "[/Lens_Usage]\n");
+	
+	free(counts);
+	munmap(map, file_stat.st_size);
+	return true;
+}
+
+/**
+ * CR2_type_name
+ * Return:
+ *   The name of the TIFF type ("UNKNOWN" if it isn't a TIFF type).
+ */
+const char* CR2_type_name(u16 tag_type) {
+	return CR2_TIFF_TYPES[(tag_type <= TIFF_TYPE_LAST) ? tag_type : 0].name;
+}
+
+/**
+ * CR2_entry_is_inline
+ * Return:
+ *   True if the values of the entry are stored in the entry itself
+ *   (4 bytes or less), false if the entry contains their offset.
+ */
+boolean CR2_entry_is_inline(CR2_IFD_Directory_Entry * entry) {
+	return (u64)entry->number_of_value * CR2_type_size(entry->tag_type) <= IFD_ENTRY_VALUE_SIZE;
+}
+
+/**
+ * CR2_get_entry_values
+ * Params:
+ *   1. the stream of the .cr2 file
+ *   2. the directory entry
+ * Return:
+ *   The values of the entry in host byte order, read from the entry itself
+ *   or from the stream, as an array of number_of_value elements of the
+ *   tag type (a RATIONAL is a couple of u32). ASCII values are always
+ *   terminated by 0x00. The array must be freed by the caller.
+ *   NULL if the type is unknown or the values cannot be read.
+ */
+void* CR2_get_entry_values(FILE * stream, CR2_IFD_Directory_Entry * entry) {
+	u32 swap_size, i;
+	u64 size;
+	u8 *values;
+	
+	if (entry == NULL || CR2_type_size(entry->tag_type) == 0 || entry->number_of_value == 0) {
+		return NULL;
+	}
+	size = (u64)entry->number_of_value * CR2_type_size(entry->tag_type);
+	if (size > MAX_TAG_VALUE_SIZE) {
+		fprintf(stderr, "[ERROR-CR2_get_entry_values] Tag 0x%X is too big\n", entry->tag_ID);
+		return NULL;
+	}
+	
+	values = (u8*)calloc(size + 1, sizeof(u8));
+	if (CR2_entry_is_inline(entry)) {
+		/* the value field was read as a u32 in the byte order of the file */
+		u32 raw_value = IS_BIG_ENDIAN ? DWORD_TO_LITTLE_ENDIAN(entry->value) : entry->value;
+		
+		memcpy(values, &raw_value, size);
+	}
+	else if (stream == NULL || fseek(stream, entry->value, SEEK_SET) != 0 ||
+			 fread(values, 1, size, stream) != size) {
+		perror("[ERROR-CR2_get_entry_values]");
+		free(values);
+		return NULL;
+	}
+	
+	swap_size = CR2_TIFF_TYPES[entry->tag_type].swap_size;
+	if (IS_BIG_ENDIAN && swap_size > 1) {
+		for (i = 0; i < size; i += swap_size) {
+			u32 k;
+			
+			for (k = 0; k < swap_size/2; k++) {
+				u8 tmp = values[i+k];
+				
+				values[i+k] = values[i+swap_size-1-k];
+				values[i+swap_size-1-k] = tmp;
+			}
+		}
+	}
+	
+	return values;
+}
+
+/**
+ * CR2_value_int
+ * Params:
+ *   1. the values returned by CR2_get_entry_values
+ *   2. their tag type
+ *   3. the index of the value
+ * Return:
+ *   The integer value (the numerator for the rationals), 0 if the values
+ *   are NULL or the type isn't an integer type.
+ *   The caller must check that index < number_of_value.
+ */
+s32 CR2_value_int(const void * values, u16 tag_type, u32 index) {
+	if (values == NULL) {
+		return 0;
+	}
+	
+	switch (tag_type) {
+		case TIFF_TYPE_BYTE:
+		case TIFF_TYPE_UNDEFINED:
+			return ((const u8*)values)[index];
+		case TIFF_TYPE_SBYTE:
+			return ((const s8*)values)[index];
+		case TIFF_TYPE_SHORT:
+			return ((const u16*)values)[index];
+		case TIFF_TYPE_SSHORT:
+			return ((const s16*)values)[index];
+		case TIFF_TYPE_LONG:
+		case TIFF_TYPE_SLONG:
+			return ((const s32*)values)[index];
+		case TIFF_TYPE_RATIONAL:
+		case TIFF_TYPE_SRATIONAL:
+			return ((const s32*)values)[2*index];
+	}
+	
+	return 0;
+}
+
+/**
+ * CR2_tag_tree_open
+ * Params:
+ *   1. the stream of the .cr2 file, that must stay open with the tree
+ *   2. the offset of the IFD
+ * Return:
+ *   The tree of the IFD, NULL if it cannot be read.
+ *   Only the directory entries are read: values and sub IFDs are read
+ *   when they are accessed. It must be freed with CR2_tag_tree_destroy.
+ */
+CR2_Tag_Tree* CR2_tag_tree_open(FILE * stream, u32 offset) {
+	CR2_Tag_Tree *tree;
+	u32 i;
+	
+	if (stream == NULL) {
+		return NULL;
+	}
+	
+	tree = (CR2_Tag_Tree*)malloc(sizeof(CR2_Tag_Tree));
+	if (CR2_get_IFD(stream, &tree->ifd, offset) == 0) {
+		free(tree);
+		return NULL;
+	}
+	
+	tree->stream = stream;
+	tree->tags = (CR2_Tag*)calloc(tree->ifd.dir_entries_length, sizeof(CR2_Tag));
+	for (i = 0; i < tree->ifd.dir_entries_length; i++) {
+		tree->tags[i].entry = tree->ifd.dir_entries[i];
+	}
+	
+	return tree;
+}
+
+/**
+ * CR2_tag_find
+ * Return:
+ *   The tag with that ID in the tree, NULL if it isn't there.
+ */
+CR2_Tag* CR2_tag_find(CR2_Tag_Tree * tree, u16 tag_ID) {
+	CR2_IFD_Directory_Entry *entry;
+	
+	if (tree == NULL || (entry = CR2_find_entry(&tree->ifd, tag_ID)) == NULL) {
+		return NULL;
+	}
+	
+	return &tree->tags[entry - tree->ifd.dir_entries];
+}
+
+/**
+ * CR2_tag_values
+ * Return:
+ *   The values of the tag (see CR2_get_entry_values). They are read the
+ *   first time and then kept in the tree, so they must not be freed.
+ */
+const void* CR2_tag_values(CR2_Tag_Tree * tree, CR2_Tag * tag) {
+	if (tree == NULL || tag == NULL) {
+		return NULL;
+	}
+	
+	if (tag->values == NULL) {
+		tag->values = CR2_get_entry_values(tree->stream, &tag->entry);
+	}
+	
+	return tag->values;
+}
+
+/**
+ * CR2_tag_subtree
+ * Return:
+ *   The tree of the IFD pointed by the tag (i.e. EXIF, MakerNote or GPS),
+ *   NULL if the tag is missing. It is read the first time and then kept
+ *   in the tree, so it must not be freed.
+ */
+CR2_Tag_Tree* CR2_tag_subtree(CR2_Tag_Tree * tree, u16 tag_ID) {
+	CR2_Tag *tag = CR2_tag_find(tree, tag_ID);
+	
+	if (tag == NULL) {
+		return NULL;
+	}
+	
+	if (tag->children == NULL) {
+		tag->children = CR2_tag_tree_open(tree->stream, tag->entry.value);
+	}
+	
+	return tag->children;
+}
+
+/**
+ * CR2_tag_tree_destroy
+ * It frees the tree, with all the values and sub trees read.
+ */
+boolean CR2_tag_tree_destroy(CR2_Tag_Tree * tree) {
+	if (tree != NULL) {
+		u32 i;
+		
+		for (i = 0; i < tree->ifd.dir_entries_length; i++) {
+			free(tree->tags[i].values);
+			CR2_tag_tree_destroy(tree->tags[i].children);
+		}
+		free(tree->tags);
+		free(tree->ifd.dir_entries);
+		free(tree);
+		
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * CR2_MAKERNOTE_FIELDS
+ * The known elements of the Canon MakerNote arrays.
+ * The white balance of ColorData depends on its version,
+ * see CR2_color_data_WB_index.
+ */
+static const CR2_MakerNote_Field CR2_MAKERNOTE_FIELDS[] = {
+	{CR2_TAG_CAMERA_SETTINGS,  1, true,  "CameraSettings.MacroMode"},
+	{CR2_TAG_CAMERA_SETTINGS,  2, true,  "CameraSettings.SelfTimer"},
+	{CR2_TAG_CAMERA_SETTINGS,  3, true,  "CameraSettings.Quality"},
+	{CR2_TAG_CAMERA_SETTINGS,  4, true,  "CameraSettings.FlashMode"},
+	{CR2_TAG_CAMERA_SETTINGS,  5, true,  "CameraSettings.ContinuousDrive"},
+	{CR2_TAG_CAMERA_SETTINGS,  7, true,  "CameraSettings.FocusMode"},
+	{CR2_TAG_CAMERA_SETTINGS, 10, true,  "CameraSettings.ImageSize"},
+	{CR2_TAG_CAMERA_SETTINGS, 11, true,  "CameraSettings.EasyMode"},
+	{CR2_TAG_CAMERA_SETTINGS, 16, true,  "CameraSettings.CameraISO"},
+	{CR2_TAG_CAMERA_SETTINGS, 17, true,  "CameraSettings.MeteringMode"},
+	{CR2_TAG_CAMERA_SETTINGS, 20, true,  "CameraSettings.ExposureMode"},
+	{CR2_TAG_CAMERA_SETTINGS, 22, false, "CameraSettings.LensType"},
+	{CR2_TAG_CAMERA_SETTINGS, 23, false, "CameraSettings.MaxFocalLength"},
+	{CR2_TAG_CAMERA_SETTINGS, 24, false, "CameraSettings.MinFocalLength"},
+	{CR2_TAG_CAMERA_SETTINGS, 25, true,  "CameraSettings.FocalUnits"},
+	{CR2_TAG_SHOT_INFO,        1, true,  "ShotInfo.AutoISO"},
+	{CR2_TAG_SHOT_INFO,        2, true,  "ShotInfo.BaseISO"},
+	{CR2_TAG_SHOT_INFO,        3, true,  "ShotInfo.MeasuredEV"},
+	{CR2_TAG_SHOT_INFO,        4, true,  "ShotInfo.TargetAperture"},
+	{CR2_TAG_SHOT_INFO,        5, true,  "ShotInfo.TargetExposureTime"},
+	{CR2_TAG_SHOT_INFO,        6, true,  "ShotInfo.ExposureCompensation"},
+	{CR2_TAG_SHOT_INFO,        7, true,  "ShotInfo.WhiteBalance"},
+	{CR2_TAG_SHOT_INFO,        9, true,  "ShotInfo.SequenceNumber"},
+	{CR2_TAG_SHOT_INFO,       19, false, "ShotInfo.FocusDistanceUpper"},
+	{CR2_TAG_SHOT_INFO,       20, false, "ShotInfo.FocusDistanceLower"},
+	{CR2_TAG_SENSOR_INFO,      1, false, "SensorInfo.SensorWidth"},
+	{CR2_TAG_SENSOR_INFO,      2, false, "SensorInfo.SensorHeight"},
+	{CR2_TAG_SENSOR_INFO,      5, false, "SensorInfo.SensorLeftBorder"},
+	{CR2_TAG_SENSOR_INFO,      6, false, "SensorInfo.SensorTopBorder"},
+	{CR2_TAG_SENSOR_INFO,      7, false, "SensorInfo.SensorRightBorder"},
+	{CR2_TAG_SENSOR_INFO,      8, false, "SensorInfo.SensorBottomBorder"},
+	{CR2_TAG_COLOR_DATA,       0, true,  "ColorData.ColorDataVersion"}
+};
+
+/**
+ * CR2_COLOR_DATA_VERSIONS
+ * The known ColorData versions, identified by their length.
+ */
+static const CR2_Color_Data_Version CR2_COLOR_DATA_VERSIONS[] = {
+	{582,  0x19, 0x000}, /* 1 */
+	{653,  0x22, 0x000}, /* 2 */
+	{796,  0x3F, 0x000}, /* 3 */
+	{674,  0x3F, 0x2B9}, /* 4 */
+	{692,  0x3F, 0x2B9},
+	{702,  0x3F, 0x2B9},
+	{1227, 0x3F, 0x2B9},
+	{1250, 0x3F, 0x2B9},
+	{1251, 0x3F, 0x2B9},
+	{1337, 0x3F, 0x2B9},
+	{1338, 0x3F, 0x2B9},
+	{1346, 0x3F, 0x2B9},
+	{5120, 0x47, 0x000}, /* 5 */
+	{1273, 0x3F, 0x000}, /* 6 */
+	{1275, 0x3F, 0x000},
+	{1312, 0x3F, 0x305}, /* 7 */
+	{1313, 0x3F, 0x305},
+	{1316, 0x3F, 0x305},
+	{1506, 0x3F, 0x305},
+	{1353, 0x3F, 0x000}, /* 8 */
+	{1560, 0x3F, 0x000},
+	{1592, 0x3F, 0x000},
+	{1602, 0x3F, 0x000},
+	{1816, 0x47, 0x000}, /* 9 */
+	{1820, 0x47, 0x000},
+	{1824, 0x47, 0x000},
+	{2024, 0x55, 0x000}, /* 10 */
+	{3656, 0x55, 0x000},
+	{3778, 0x69, 0x000}, /* 11 */
+	{3973, 0x69, 0x000}
+};
+
+/**
+ * CR2_color_data_version
+ * Return:
+ *   The ColorData version with that length, NULL if it is unknown.
+ */
+static const CR2_Color_Data_Version* CR2_color_data_version(u32 count) {
+	u32 i;
+	
+	for (i = 0; i < sizeof(CR2_COLOR_DATA_VERSIONS)/sizeof(CR2_COLOR_DATA_VERSIONS[0]); i++) {
+		if (CR2_COLOR_DATA_VERSIONS[i].count == count) {
+			return &CR2_COLOR_DATA_VERSIONS[i];
+		}
+	}
+	
+	return NULL;
+}
+
+/**
+ * CR2_color_data_WB_index
+ * Return:
+ *   The index of WB_RGGBLevelsAsShot in the ColorData array,
+ *   that depends on the ColorData version (i.e. on its length).
+ *   0 if the version is unknown.
+ */
+u32 CR2_color_data_WB_index(u32 count) {
+	const CR2_Color_Data_Version *version = CR2_color_data_version(count);
+	
+	return (version != NULL) ? version->wb_index : 0;
+}
+
+/**
+ * CR2_color_data_white_level_index
+ * Return:
+ *   The index of SpecularWhiteLevel in the ColorData array,
+ *   0 if the version is unknown or does not have it.
+ */
+u32 CR2_color_data_white_level_index(u32 count) {
+	const CR2_Color_Data_Version *version = CR2_color_data_version(count);
+	
+	return (version != NULL) ? version->white_level_index : 0;
+}
+
+/**
+ * CR2_makernote_field
+ * Params:
+ *   1. the MakerNote tree
+ *   2. the tag of the array (i.e. CR2_TAG_COLOR_DATA)
+ *   3. the index of the element in the array
+ *   4. the buffer used for storing the value
+ * Return:
+ *   False if the array is missing or shorter.
+ *   Only the requested array is read and decoded.
+ */
+boolean CR2_makernote_field(CR2_Tag_Tree * makernote, u16 array_tag, u32 index, s32 * value) {
+	CR2_Tag *tag = CR2_tag_find(makernote, array_tag);
+	const void *values;
+	
+	if (tag == NULL || index >= tag->entry.number_of_value || (values = CR2_tag_values(makernote, tag)) == NULL) {
+		return false;
+	}
+	
+	*value = CR2_value_int(values, tag->entry.tag_type, index);
+	return true;
+}
+
+/**
+ * CR2_print_makernote
+ * Params:
+ *   1. the stream where you want to print the MakerNote
+ *   2. the MakerNote tree
+ * Return:
+ *   False if something goes wrong, true instead.
+ *
+ * It prints the known fields of the MakerNote arrays that are present:
+ *   [MakerNote]
+ *     %s: %d
+ *     ColorData.WB_RGGBLevelsAsShot: %d %d %d %d
+ *     ColorData.SpecularWhiteLevel: %d
+ *   [/MakerNote]
+ */
+boolean CR2_print_makernote(FILE * stream, CR2_Tag_Tree * makernote) {
+	if (stream != NULL && makernote != NULL) {
+		CR2_Tag *tag;
+		s32 value;
+		u32 wb_index, i;
+		
+		fprintf(stream, "[MakerNote]\n");
+		for (i = 0; i < sizeof(CR2_MAKERNOTE_FIELDS)/sizeof(CR2_MAKERNOTE_FIELDS[0]); i++) {
+			const CR2_MakerNote_Field *field = &CR2_MAKERNOTE_FIELDS[i];
+			
+			if (CR2_makernote_field(makernote, field->array_tag, field->index, &value)) {
+				fprintf(stream, "\t%s: %d\n", field->name, field->is_signed ? (s16)value : (u16)value);
+			}
+		}
+		
+		tag = CR2_tag_find(makernote, CR2_TAG_COLOR_DATA);
+		wb_index = (tag != NULL) ? CR2_color_data_WB_index(tag->entry.number_of_value) : 0;
+		if (wb_index != 0) {
+			fprintf(stream, "\tColorData.WB_RGGBLevelsAsShot:");
+			for (i = 0; i < 4 && CR2_makernote_field(makernote, CR2_TAG_COLOR_DATA, wb_index + i, &value); i++) {
+				fprintf(stream, " %d", value);
+			}
+			fprintf(stream, "\n");
+		}
+		if (tag != NULL && CR2_color_data_white_level_index(tag->entry.number_of_value) != 0 &&
+			CR2_makernote_field(makernote, CR2_TAG_COLOR_DATA, CR2_color_data_white_level_index(tag->entry.number_of_value), &value)) {
+			fprintf(stream, "\tColorData.SpecularWhiteLevel: %d\n", value);
+		}
+		fprintf(stream, "[/MakerNote]\n");
+		
+		return true;
+	}
+	
+	return false;
+}